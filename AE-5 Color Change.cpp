@@ -1,357 +1,3397 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
-#include <sys/mman.h>
-#include <cstdint>
-#include <unistd.h>
-#include <string.h>
 #include <errno.h>
-#include <dirent.h>
-#include <fstream>
 #include <string>
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <new>
+#include <thread>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <grp.h>
+#include <sys/un.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <limits.h>
+#include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
 
-// Hardware configuration constants
-#define MMIO_REGION_SIZE 0x1024
-#define LED_CONTROL_OFFSET 0x320
-#define NUM_LEDS 5
+#ifdef AE5_WITH_ALSA
+#include <alsa/asoundlib.h>
+#endif
 
-// LED protocol constants
-#define START_FRAME_BITS 32
-#define BRIGHTNESS_BITS 8
-#define COLOR_BITS 24
-#define WRITE_ITERATIONS 2
+#include "ae5rgb.h"
 
-// LED protocol values
-#define LED_BIT_LOW 0x02
-#define LED_BIT_HIGH 0x102
-#define LED_CLOCK_HIGH 0x103
-#define LED_CLOCK_LOW 0x03
+// Daemon configuration
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_MAX_ARGS 32
+#define DAEMON_MAX_BACKLOG 65536 // reply bytes a client may leave unread before it is dropped
+#define DAEMON_MAX_LAYERS 16
+#define DAEMON_LAYER_PRIORITY 1 // default priority of a layer; requests without a layer are underneath
+#define DAEMON_MAX_TTL_MS 86400000
+#define MAX_OPACITY 0xFF
 
-// PCI device identification
-#define TARGET_VENDOR "1102"
-#define TARGET_DEVICE "0012"
-#define TARGET_REGION 2
+// Watch mode
+#define WATCH_DEFAULT_INTERVAL_MS 1000 // how often sysfs and /proc sources are read
+#define WATCH_LOAD_SOURCE "/proc/loadavg"
+#define FRAME_QUEUE_SIZE 64 // pending snapshots in FIFO mode, a power of two
+#define SHM_FRAME_MAGIC 0x4d533541 // "AE5M", layout of SharedFrames
+#define SHM_PUBLISH_TIMEOUT_MS 200 // clients give up on a region locked this long
+#define SHM_STUCK_MS 50 // the daemon unlocks a region left locked this long
 
-// Type definition for MMIO register access
-typedef volatile uint32_t* mmio_reg_t;
+// Effect engine defaults
+#define EFFECT_DEFAULT_FPS 30
+#define EFFECT_MAX_FPS 1000
+#define EFFECT_DEFAULT_PERIOD_MS 2000
+
+// Show files: a ShowHeader, then SHOW_FRAME_SIZE bytes of r,g,b per LED for each frame
+#define SHOW_MAGIC "AE5S"
+#define SHOW_VERSION 1
+#define SHOW_FRAME_SIZE (NUM_LEDS * 3)
+
+// Audio mode: S16_LE input, analysed one period at a time
+#define AUDIO_RATE 48000
+#define AUDIO_CHANNELS 2
+#define AUDIO_PERIOD_FRAMES 256 // 5.3 ms
+#define AUDIO_BUFFER_US 16000   // ALSA capture buffer
+#define AUDIO_LOWEST_BAND_HZ 50 // LED 0; each next LED two octaves higher
+#define AUDIO_BAND_Q 2.0
+#define AUDIO_FLOOR_DB -48      // dBFS shown as off
+#define AUDIO_RELEASE_MS 150
+
+// Metrics export
+#define METRICS_INTERVAL_MS 10000
+
+// Benchmark defaults
+#define BENCH_DEFAULT_ITERATIONS 1000
+
+// Real-time writer setup
+#define RT_PREFAULT_STACK_SIZE (256 * 1024)
+
+void print_usage(const char* program_name) {
+    fprintf(stderr, "AE-5 RGB Controller\n");
+    fprintf(stderr, "===================================\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  Single color for all LEDs:\n");
+    fprintf(stderr, "    %s <r> <g> <b>\n", program_name);
+    fprintf(stderr, "    %s '#rrggbb'\n\n", program_name);
+    fprintf(stderr, "  Different colors per LED:\n");
+    fprintf(stderr, "    %s [<card>:]<led_position>:<r,g,b>[@<brightness>] ...\n\n", program_name);
+    fprintf(stderr, "  Daemon mode (keeps the device mapped, reads frames from a Unix socket):\n");
+    fprintf(stderr, "    %s --daemon [--socket <path>] [initial frame]\n\n", program_name);
+    fprintf(stderr, "  Animated effects:\n");
+    fprintf(stderr, "    %s --effect <effect> [--fps <n>] [--duration <seconds>]\n", program_name);
+    fprintf(stderr, "    %s --keyframes <file> [--fps <n>] [--duration <seconds>]\n", program_name);
+    fprintf(stderr, "    %s --play <show> [--duration <seconds>]\n\n", program_name);
+    fprintf(stderr, "  Record what a running daemon shows on a card into a show file (until stopped):\n");
+    fprintf(stderr, "    %s --record <show> [--card <n>] [--fps <n>] [--duration <seconds>]\n\n", program_name);
+    fprintf(stderr, "  Show audio levels, one frequency band per LED (colors from the frame, if given):\n");
+    fprintf(stderr, "    arecord -f S16_LE -r %d -c %d --buffer-time=%d | %s --audio - [frame]\n",
+            AUDIO_RATE, AUDIO_CHANNELS, AUDIO_BUFFER_US, program_name);
+    fprintf(stderr, "    %s --audio <file or ALSA device> [frame]\n\n", program_name);
+    fprintf(stderr, "  Stream frames, one per line in either format above, from standard input:\n");
+    fprintf(stderr, "    %s --stdin < frames.txt\n\n", program_name);
+    fprintf(stderr, "  Map sensor readings and status files to colors, following a rules file:\n");
+    fprintf(stderr, "    %s --watch <rules> [--layer <name> ...]\n", program_name);
+    fprintf(stderr, "    (rule lines: <path or load> <comparison> <threshold> <frame>, e.g.\n");
+    fprintf(stderr, "     /sys/class/hwmon/hwmon0/temp1_input >= 80000 0:#ff0000; the first rule that\n");
+    fprintf(stderr, "     holds sets each LED; \"interval <ms>\" sets how often sysfs and /proc are read)\n\n");
+    fprintf(stderr, "  Benchmark the frame writers:\n");
+    fprintf(stderr, "    %s --bench [--iterations <n>] [--dry-run] [frame]\n\n", program_name);
+    fprintf(stderr, "  Find the fastest clock timing the LEDs show correctly (interactive):\n");
+    fprintf(stderr, "    %s --calibrate [--device <bdf> ...]\n\n", program_name);
+    fprintf(stderr, "  Check the frame encoders against each other (no hardware needed):\n");
+    fprintf(stderr, "    %s --self-test [--iterations <n>]\n\n", program_name);
+    fprintf(stderr, "Arguments:\n");
+    fprintf(stderr, "  card        : Card number (0-%d) in PCI address order. Without it a\n", MAX_CARDS-1);
+    fprintf(stderr, "                setting applies to every card; cards not mentioned are left alone\n");
+    fprintf(stderr, "  led_position : LED number (0-%d)\n", NUM_LEDS-1);
+    fprintf(stderr, "  r,g,b       : RGB values (0-255), or #rrggbb\n");
+    fprintf(stderr, "  brightness  : LED brightness (0-%d, sent in %d steps), overrides --brightness\n",
+            MAX_BRIGHTNESS, 1 << GLOBAL_BRIGHTNESS_BITS);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  --daemon          : Run as a daemon and accept frames on a Unix socket\n");
+    fprintf(stderr, "                      (cards are mapped again after hotplug and resent their frame after resume)\n");
+    fprintf(stderr, "  --shm <name>      : With --daemon, also take frames from a shared memory region\n");
+    fprintf(stderr, "                      (/dev/shm/<name>); without it, send the frame through that\n");
+    fprintf(stderr, "                      region of a running daemon\n");
+    fprintf(stderr, "  --shm-group <group> : With --daemon --shm, let this group use the region too\n");
+    fprintf(stderr, "                      (by default only the daemon's user may)\n");
+    fprintf(stderr, "  --metrics-file <path> : Keep Prometheus metrics for the daemon or effect in this file,\n");
+    fprintf(stderr, "                      refreshed every %d seconds (daemons also answer a \"stats\" request)\n",
+            METRICS_INTERVAL_MS / 1000);
+    fprintf(stderr, "  --trace <file>    : Record the discovery, mapping and frame phases and write them to\n");
+    fprintf(stderr, "                      this file as Chrome trace JSON on exit (builds with\n");
+    fprintf(stderr, "                      -DAE5_WITH_TRACE only)\n");
+    fprintf(stderr, "  --queue <mode>    : Daemon frame queue: latest (default, a burst of requests becomes\n");
+    fprintf(stderr, "                      one frame) or fifo (every request is written, in order)\n");
+    fprintf(stderr, "  --socket <path>   : Daemon socket path (default: %s)\n", DAEMON_SOCKET_PATH);
+    fprintf(stderr, "  --brightness <n>  : Brightness field for every LED (0-%d, default: %d)\n",
+            MAX_BRIGHTNESS, MAX_BRIGHTNESS);
+    fprintf(stderr, "  --device <bdf>    : PCI address of a card, e.g. 0000:03:00.0 (skips the device scan;\n");
+    fprintf(stderr, "                      repeat for several cards, numbered in the order given)\n");
+    fprintf(stderr, "  --force           : Write the frame even if the LEDs already show it\n");
+    fprintf(stderr, "                      (daemon requests may also start with --force, --brightness\n");
+    fprintf(stderr, "                      and --fade)\n");
+    fprintf(stderr, "  --layer <name>    : Send the frame to this layer of the daemon. Layers are stacked\n");
+    fprintf(stderr, "                      over the frames sent without one, so several programs can share\n");
+    fprintf(stderr, "                      the LEDs; a layer covers only the LEDs it was given. Daemon\n");
+    fprintf(stderr, "                      requests take these options too, and --layer <name> --drop\n");
+    fprintf(stderr, "                      removes a layer\n");
+    fprintf(stderr, "  --priority <n>    : Layer stacking order, higher on top (0-255, default: %d)\n",
+            DAEMON_LAYER_PRIORITY);
+    fprintf(stderr, "  --opacity <n>     : Layer opacity (0-%d, default: %d)\n", MAX_OPACITY, MAX_OPACITY);
+    fprintf(stderr, "  --ttl <ms>        : Remove the layer after this time (default: keep it)\n");
+    fprintf(stderr, "  --fade <ms>       : Fade from the frame shown to the new one over this time (0-%d);\n",
+            FADE_MAX_MS);
+    fprintf(stderr, "                      with --daemon, the fade used by requests that don't give their own --fade\n");
+    fprintf(stderr, "  --fps <n>         : Effect and fade frame rate (default: %d)\n", EFFECT_DEFAULT_FPS);
+    fprintf(stderr, "  --duration <s>    : Stop the effect after this many seconds (default: run until killed)\n");
+    fprintf(stderr, "  --bench           : Time each frame phase and report p50/p99/max\n");
+    fprintf(stderr, "  --iterations <n>  : Benchmark or self-test iterations (default: %d)\n", BENCH_DEFAULT_ITERATIONS);
+    fprintf(stderr, "  --dry-run         : Write frames to a memory buffer instead of the card (no root needed)\n");
+    fprintf(stderr, "  --audio <source>  : Show audio levels from raw S16_LE stereo PCM at %d Hz in a file,\n",
+            AUDIO_RATE);
+    fprintf(stderr, "                      a FIFO or - (standard input)\n");
+#ifdef AE5_WITH_ALSA
+    fprintf(stderr, "                      or from an ALSA capture device such as hw:1,0\n");
+#endif
+    fprintf(stderr, "  --cpu <list>      : Pin the daemon, effect or benchmark writer to these CPUs, e.g. 3 or 2,3\n");
+    fprintf(stderr, "  --rt-priority <n> : Run the writer SCHED_FIFO at this priority (1-99)\n");
+    fprintf(stderr, "  --mlock           : Lock the process in memory and prefault the stack and MMIO mapping\n");
+    fprintf(stderr, "  --verify          : Read the register back after each frame and resend it if it did\n");
+    fprintf(stderr, "                      not arrive (up to %d sends; cards that can't be read are not checked)\n",
+            WRITE_ITERATIONS);
+    fprintf(stderr, "\nEffects:\n");
+    fprintf(stderr, "  breathe:r,g,b[:period_ms] : Fade a color in and out\n");
+    fprintf(stderr, "  pulse:r,g,b[:period_ms]   : Flash a color, then decay to off\n");
+    fprintf(stderr, "  cycle[:period_ms]         : Rotate all LEDs through the hue wheel\n");
+    fprintf(stderr, "  Keyframe files hold lines of \"<time_ms> <frame>\" using either frame format;\n");
+    fprintf(stderr, "  colors are interpolated between keyframes and the show loops.\n");
+    fprintf(stderr, "  Show files are binary: an 8-byte header (\"%s\", version, LED count, fps)\n", SHOW_MAGIC);
+    fprintf(stderr, "  and %d bytes of r,g,b per LED for each frame, played straight from the file.\n",
+            SHOW_FRAME_SIZE);
+    fprintf(stderr, "  Fades and keyframes blend perceptually: colors through a %.1f gamma curve,\n", FADE_GAMMA);
+    fprintf(stderr, "  the brightness field through CIE lightness.\n");
+    fprintf(stderr, "\nExamples:\n");
+    fprintf(stderr, "  %s 255 0 0               # Set all LEDs to red\n", program_name);
+    fprintf(stderr, "  %s 0:255,0,0             # Set LED 0 to red\n", program_name);
+    fprintf(stderr, "  %s 0:255,0,0 1:0,255,0   # Set LED 0 to red, LED 1 to green\n", program_name);
+    fprintf(stderr, "  %s 1:0:0,0,255           # Set LED 0 of the second card to blue\n", program_name);
+    fprintf(stderr, "  %s --daemon              # Start the daemon, then send it frames with e.g.\n", program_name);
+    fprintf(stderr, "    echo \"0:255,0,0\" | socat - UNIX-CONNECT:%s\n", DAEMON_SOCKET_PATH);
+    fprintf(stderr, "  %s --effect breathe:0,0,255:3000 --fps 60   # Breathe blue every 3 seconds\n", program_name);
+    fprintf(stderr, "\nNote: This program requires root privileges to access hardware.\n");
+    fprintf(stderr, "Run with sudo or as root user. Without root, a single frame is sent to the\n");
+    fprintf(stderr, "running daemon instead.\n");
+}
+
+// Scheduling setup for the writer; the defaults leave the process untouched
+struct RealtimeOptions {
+    cpu_set_t cpus;
+    bool pin = false;
+    int priority = 0; // SCHED_FIFO priority, 0 keeps the normal scheduler
+    bool lock_memory = false;
+};
+
+// Parse a CPU list such as "3" or "2,3"
+bool parse_cpu_list(const char* str, cpu_set_t& cpus) {
+    CPU_ZERO(&cpus);
+    const char* p = str;
+    while (*p) {
+        char* end;
+        long cpu = strtol(p, &end, 10);
+        if (end == p || cpu < 0 || cpu >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        CPU_SET(cpu, &cpus);
+        p = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
+
+// Touch the stack the frame writers will run on, so its pages are resident
+// before the first frame. noinline keeps the buffer from being optimised out.
+__attribute__((noinline)) void prefault_stack() {
+    volatile uint8_t stack[RT_PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Keep the frame writers from being preempted or faulting mid-frame. Threads
+ * started later (one per extra card) inherit the affinity and policy. The
+ * MMIO mappings are prefaulted with a register read so the first store of a
+ * frame never takes a page fault.
+ */
+bool apply_realtime(const RealtimeOptions& options, CardList& cards) {
+    if (options.pin && sched_setaffinity(0, sizeof(options.cpus), &options.cpus) < 0) {
+        perror("sched_setaffinity");
+        return false;
+    }
+
+    if (options.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("mlockall");
+        return false;
+    }
+
+    if (options.priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = options.priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            perror("sched_setscheduler");
+            return false;
+        }
+    }
+
+    if (options.pin || options.priority > 0 || options.lock_memory) {
+        prefault_stack();
+        for (auto& card : cards) {
+            card->io.read(LED_CONTROL_OFFSET);
+        }
+    }
+    return true;
+}
+
+static volatile sig_atomic_t g_stop_requested = 0;
+
+void handle_stop_signal(int) {
+    g_stop_requested = 1;
+}
+
+// Long-running modes exit cleanly on SIGINT/SIGTERM
+void install_stop_handlers() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+// Split a request line into an argv-style array, with args[0] as a placeholder
+// program name so it can go through the same parser as the command line.
+// Returns the argument count, or -1 if there are more than max_args arguments.
+int split_request_args(char* line, char* args[], int max_args) {
+    int count = 0;
+    args[count++] = (char*)"ae5-rgb";
+
+    char* save = nullptr;
+    for (char* tok = strtok_r(line, " \t\r", &save); tok; tok = strtok_r(nullptr, " \t\r", &save)) {
+        if (count > max_args) {
+            return -1;
+        }
+        args[count++] = tok;
+    }
+    return count;
+}
+
+// The daemon's frames as handed from the request thread to the writer
+struct FrameSnapshot {
+    CardFrames frames;
+    uint32_t update[MAX_CARDS];  // bumped by every request that sets the card
+    uint32_t force[MAX_CARDS];   // bumped by every forced write of the card
+    uint32_t fade_ms[MAX_CARDS]; // fade of the card's latest update, 0 to cut
+};
+
+void make_snapshot(const CardFrames& frames, const uint32_t* update, const uint32_t* force,
+                   const uint32_t* fade_ms, FrameSnapshot& snapshot) {
+    snapshot.frames = frames;
+    memcpy(snapshot.update, update, sizeof(snapshot.update));
+    memcpy(snapshot.force, force, sizeof(snapshot.force));
+    memcpy(snapshot.fade_ms, fade_ms, sizeof(snapshot.fade_ms));
+}
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32-bit integers");
+
+// Futex words in shared memory need the non-private operations. timeout is
+// relative; without one the wait only ends on a wake.
+void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, bool shared = false,
+                const struct timespec* timeout = nullptr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+            expected, timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t>& word, bool shared = false) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Shared-memory frame buffer exported by the daemon with --shm. Other
+ * processes map it and write colors in place; the daemon's writer sleeps on
+ * the doorbell, which is also the futex word the socket requests ring.
+ *
+ * Writer protocol: move seq from even to odd with a compare-exchange (that
+ * also keeps two clients apart), store the frames and valid flags, make seq
+ * even again, bump doorbell and, if writer_waiting is set, FUTEX_WAKE it.
+ * publish_shared_frames() does exactly that. A client that dies with seq odd
+ * would lock every other one out, so clients only wait a bounded time and
+ * the daemon takes the lock back once seq has been stuck for SHM_STUCK_MS:
+ * a writer that wakes to an odd seq sleeps with a timeout from then on and
+ * recovers the region itself, so it needs no second client to ring it.
+ */
+struct SharedFrames {
+    uint32_t magic;
+    uint32_t num_cards;
+    alignas(64) std::atomic<uint32_t> doorbell;
+    std::atomic<uint32_t> writer_waiting;
+    alignas(64) std::atomic<uint32_t> seq;
+    uint8_t valid[MAX_CARDS];
+    LEDFrame frames[MAX_CARDS];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be address-free");
+
+// Create the daemon's region, seeded with the frames already on the LEDs. Unlike
+// the socket, clients write the lock word directly, so only the daemon's user
+// and, if given, one group may map it.
+SharedFrames* create_shared_frames(const char* name, gid_t group, const CardFrames& initial) {
+    shm_unlink(name);
+    ScopedFD fd(shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+    if (fd.get() < 0) {
+        perror("Failed to create shared frame buffer");
+        return nullptr;
+    }
+    if (group != (gid_t)-1 && (fchown(fd.get(), -1, group) < 0 || fchmod(fd.get(), 0660) < 0)) {
+        perror("Failed to give the shared frame buffer to its group");
+        shm_unlink(name);
+        return nullptr;
+    }
+    if (ftruncate(fd.get(), sizeof(SharedFrames)) < 0) {
+        perror("Failed to size shared frame buffer");
+        shm_unlink(name);
+        return nullptr;
+    }
+
+    void* region = mmap(nullptr, sizeof(SharedFrames), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (region == MAP_FAILED) {
+        perror("Failed to map shared frame buffer");
+        shm_unlink(name);
+        return nullptr;
+    }
+
+    SharedFrames* shared = new (region) SharedFrames();
+    shared->num_cards = initial.size();
+    for (uint32_t card = 0; card < shared->num_cards; card++) {
+        shared->valid[card] = initial.has(card);
+        shared->frames[card] = initial.frames[card];
+    }
+    // Clients check the magic, so set it last
+    std::atomic_thread_fence(std::memory_order_release);
+    shared->magic = SHM_FRAME_MAGIC;
+    return shared;
+}
+
+void destroy_shared_frames(const char* name, SharedFrames* shared) {
+    munmap(shared, sizeof(SharedFrames));
+    shm_unlink(name);
+}
+
+// Map a running daemon's region as a client
+SharedFrames* open_shared_frames(const char* name) {
+    ScopedFD fd(shm_open(name, O_RDWR | O_CLOEXEC, 0));
+    if (fd.get() < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) < 0 || (size_t)st.st_size < sizeof(SharedFrames)) {
+        return nullptr;
+    }
+    void* region = mmap(nullptr, sizeof(SharedFrames), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (region == MAP_FAILED) {
+        return nullptr;
+    }
+    SharedFrames* shared = static_cast<SharedFrames*>(region);
+    if (shared->magic != SHM_FRAME_MAGIC || shared->num_cards > MAX_CARDS) {
+        munmap(region, sizeof(SharedFrames));
+        return nullptr;
+    }
+    return shared;
+}
+
+void ring_shared_frames(SharedFrames* shared) {
+    shared->doorbell.fetch_add(1);
+    if (shared->writer_waiting.load()) {
+        futex_wake(shared->doorbell, true);
+    }
+}
+
+/**
+ * Client side of the protocol above: store the valid frames and ring the
+ * writer. A client that finds the region locked rings the writer once, which
+ * then unlocks it after SHM_STUCK_MS if the holder never finishes. Returns
+ * false if the lock is still held after SHM_PUBLISH_TIMEOUT_MS.
+ */
+bool publish_shared_frames(SharedFrames* shared, const CardFrames& frames) {
+    uint32_t seq = shared->seq.load(std::memory_order_relaxed);
+    uint64_t deadline = 0;
+    for (;;) {
+        if (!(seq & 1) && shared->seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) break;
+        if (seq & 1) {
+            uint64_t now = monotonic_ns();
+            if (deadline == 0) {
+                deadline = now + SHM_PUBLISH_TIMEOUT_MS * 1000000ULL;
+                ring_shared_frames(shared);
+            } else if (now >= deadline) {
+                return false;
+            }
+            sched_yield();
+            seq = shared->seq.load(std::memory_order_relaxed);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t card = 0; card < frames.size() && card < shared->num_cards; card++) {
+        if (!frames.has(card)) continue;
+        shared->frames[card] = frames.frames[card];
+        shared->valid[card] = 1;
+    }
+
+    shared->seq.store(seq + 2, std::memory_order_release);
+    ring_shared_frames(shared);
+    return true;
+}
+
+/**
+ * Latest-wins handoff: a triple buffer. The producer fills its back slot and
+ * swaps it with the middle one; the consumer swaps its front slot with the
+ * middle one when that holds a fresh snapshot. Neither side ever waits, and
+ * a burst of publishes between two takes leaves only the newest.
+ */
+class FrameMailbox {
+public:
+    FrameSnapshot& back() { return slots_[back_]; }
+
+    // Returns true if this replaced a snapshot the consumer never took
+    bool publish() {
+        uint8_t old = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel);
+        back_ = old & INDEX;
+        return old & FRESH;
+    }
+
+    const FrameSnapshot* take() {
+        if (!(middle_.load(std::memory_order_relaxed) & FRESH)) {
+            return nullptr;
+        }
+        front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+        return &slots_[front_];
+    }
+
+private:
+    static constexpr uint8_t INDEX = 0x03;
+    static constexpr uint8_t FRESH = 0x04;
+
+    FrameSnapshot slots_[3];
+    alignas(64) std::atomic<uint8_t> middle_{1};
+    alignas(64) uint8_t back_ = 0;  // producer only
+    alignas(64) uint8_t front_ = 2; // consumer only
+};
+
+// Bounded single-producer/single-consumer FIFO of snapshots
+class FrameRing {
+public:
+    bool push(const FrameSnapshot& snapshot) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == FRAME_QUEUE_SIZE) {
+            return false;
+        }
+        slots_[head % FRAME_QUEUE_SIZE] = snapshot;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    const FrameSnapshot* front() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots_[tail % FRAME_QUEUE_SIZE];
+    }
+
+    void pop() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+    static_assert((FRAME_QUEUE_SIZE & (FRAME_QUEUE_SIZE - 1)) == 0, "FRAME_QUEUE_SIZE must be a power of two");
+
+    FrameSnapshot slots_[FRAME_QUEUE_SIZE];
+    alignas(64) std::atomic<uint32_t> head_{0};
+    alignas(64) std::atomic<uint32_t> tail_{0};
+};
+
+/**
+ * Hardware writer thread behind the daemon. submit() copies a snapshot into
+ * the mailbox (latest wins, a burst becomes one hardware frame) or the ring
+ * (FIFO, every snapshot is written in order) and only enters the kernel to
+ * wake the writer when it is asleep. In FIFO mode a full ring makes submit()
+ * wait for the writer; latest-wins never waits.
+ *
+ * Each source only writes the cards it changed: socket snapshots carry
+ * per-card update counters, and frames in the shared region are written
+ * when they differ from what the writer last took from it.
+ *
+ * A socket update with a fade starts a Transition from whatever the card
+ * shows; the writer then also wakes every step_ns to write the next step of
+ * each fade. Any other write to the card cuts its fade short.
+ */
+class FrameWriter {
+public:
+    FrameWriter(CardList& cards, const CardFrames& written, bool fifo, SharedFrames* shared, uint64_t step_ns)
+        : cards_(cards), written_(written), changed_(cards.size()), fifo_(fifo), step_ns_(step_ns), shared_(shared),
+          doorbell_(shared ? shared->doorbell : local_doorbell_),
+          writer_waiting_(shared ? shared->writer_waiting : local_waiting_) {
+        memset(updated_, 0, sizeof(updated_));
+        memset(forced_, 0, sizeof(forced_));
+        if (shared_) {
+            memcpy(shared_valid_, shared_->valid, sizeof(shared_valid_));
+            memcpy(shared_frames_, shared_->frames, sizeof(shared_frames_));
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~FrameWriter() { stop(); }
+
+    void submit(const FrameSnapshot& snapshot) {
+        if (fifo_) {
+            for (;;) {
+                uint32_t consumed = consumed_.load();
+                if (ring_.push(snapshot)) break;
+                producer_waiting_.store(true);
+                futex_wait(consumed_, consumed);
+                producer_waiting_.store(false);
+            }
+        } else {
+            mailbox_.back() = snapshot;
+            if (mailbox_.publish()) {
+                g_metrics.coalesced.add();
+            }
+        }
+        ring_doorbell();
+    }
+
+    // Write everything submitted so far, then end the thread
+    void stop() {
+        if (!thread_.joinable()) return;
+        stop_.store(true);
+        ring_doorbell();
+        thread_.join();
+    }
+
+    // The frames on the LEDs; only valid once the writer has stopped
+    const CardFrames& written() const { return written_; }
+
+    /*
+     * Hotplug and resume, from the daemon's event loop. The writer handles
+     * them between frames, so a mapping never changes under a write. A card
+     * that was removed is skipped until it comes back; then it is mapped
+     * again and, like every card after a resume, sent its last frame.
+     */
+    void card_removed(size_t card) {
+        removed_.fetch_or(1 << card);
+        ring_doorbell();
+    }
+    void card_added(size_t card) {
+        added_.fetch_or(1 << card);
+        ring_doorbell();
+    }
+    void resend(uint8_t cards) {
+        resend_.fetch_or(cards);
+        ring_doorbell();
+    }
+
+private:
+    void ring_doorbell() {
+        doorbell_.fetch_add(1);
+        if (writer_waiting_.load()) {
+            futex_wake(doorbell_, shared_ != nullptr);
+        }
+    }
+
+    void run() {
+        for (;;) {
+            uint32_t doorbell = doorbell_.load();
+            bool stopping = stop_.load();
+            handle_card_events();
+            drain();
+            // Fades still running at the end jump to their targets
+            uint64_t now = stopping ? UINT64_MAX : monotonic_ns();
+            if (fading_ && now >= next_step_ns_) {
+                step_transitions(now);
+            }
+            if (stopping) break;
+
+            // Wake for the next fade step, and to unlock a stuck shared region
+            uint64_t wake_ns = fading_ ? next_step_ns_ : UINT64_MAX;
+            if (stuck_seq_) {
+                wake_ns = std::min<uint64_t>(wake_ns, stuck_since_ + SHM_STUCK_MS * 1000000ULL);
+            }
+            struct timespec timeout;
+            if (wake_ns != UINT64_MAX) {
+                uint64_t wait = wake_ns > now ? wake_ns - now : 0;
+                timeout.tv_sec = wait / 1000000000ULL;
+                timeout.tv_nsec = wait % 1000000000ULL;
+            }
+            writer_waiting_.store(1);
+            if (doorbell_.load() == doorbell) {
+                futex_wait(doorbell_, doorbell, shared_ != nullptr, wake_ns != UINT64_MAX ? &timeout : nullptr);
+            }
+            writer_waiting_.store(0);
+        }
+    }
+
+    void handle_card_events() {
+        offline_ |= removed_.exchange(0);
+        uint8_t added = added_.exchange(0);
+        uint8_t resend = resend_.exchange(0);
+        for (size_t card = 0; card < cards_.size(); card++) {
+            if (!((added >> card) & 0x01)) continue;
+            if (reopen_card(*cards_[card])) {
+                offline_ &= ~(1 << card);
+                resend |= 1 << card;
+            } else {
+                offline_ |= 1 << card;
+                fprintf(stderr, "Warning: Card %zu came back but could not be mapped\n", card);
+            }
+        }
+        for (size_t card = 0; card < cards_.size(); card++) {
+            if (((resend & ~offline_) >> card) & 0x01 && written_.has(card)) {
+                queue_card(card, written_.frames[card], true);
+            }
+        }
+        flush();
+    }
+
+    void step_transitions(uint64_t now) {
+        LEDFrame frame;
+        for (size_t card = 0; card < cards_.size(); card++) {
+            if (!((fading_ >> card) & 0x01)) continue;
+            transitions_[card].render(now, frame);
+            queue_card(card, frame, false);
+            if (!transitions_[card].active) {
+                fading_ &= ~(1 << card);
+            }
+        }
+        flush();
+        next_step_ns_ = now + step_ns_;
+    }
+
+    void drain() {
+        if (!fifo_) {
+            const FrameSnapshot* snapshot = mailbox_.take();
+            if (snapshot) write_snapshot(*snapshot);
+        } else {
+            const FrameSnapshot* snapshot;
+            while ((snapshot = ring_.front()) != nullptr) {
+                write_snapshot(*snapshot);
+                ring_.pop();
+                consumed_.fetch_add(1);
+                if (producer_waiting_.load()) {
+                    futex_wake(consumed_);
+                }
+            }
+        }
+        if (shared_) {
+            write_shared();
+        }
+    }
+
+    // A client that died while publishing leaves seq odd. Once it has stayed at
+    // the same odd value for SHM_STUCK_MS, the half-written update is dropped;
+    // until then run() sleeps no longer than that.
+    void recover_shared(uint32_t seq) {
+        uint64_t now = monotonic_ns();
+        if (seq != stuck_seq_) {
+            stuck_seq_ = seq;
+            stuck_since_ = now;
+            return;
+        }
+        if (now - stuck_since_ < SHM_STUCK_MS * 1000000ULL) return;
+        if (shared_->seq.compare_exchange_strong(seq, seq + 1)) {
+            fprintf(stderr, "Warning: A shared memory client never finished its update, unlocking the region\n");
+            shared_seq_ = seq + 1;
+        }
+        stuck_seq_ = 0;
+    }
+
+    // Fade a card from what it shows now, or queue the frame at once if it has none
+    void fade_card(size_t card, const LEDFrame& frame, uint32_t fade_ms) {
+        if (!written_.has(card)) {
+            queue_card(card, frame, false);
+            return;
+        }
+        transitions_[card].begin(written_.frames[card], frame, monotonic_ns(), fade_ms * 1000000ULL);
+        fading_ |= 1 << card;
+    }
+
+    // Queue a card's frame unless the LEDs already show it
+    void queue_card(size_t card, const LEDFrame& frame, bool forced) {
+        if (forced || !written_.has(card) || !same_frame(written_.frames[card], frame)) {
+            changed_.set(card, frame);
+        }
+    }
+
+    // Frames for cards that are gone are only kept, for when they come back
+    void flush() {
+        if (changed_.present) {
+            if (offline_) {
+                CardFrames online = changed_;
+                online.present &= ~offline_;
+                send_card_frames(cards_, online);
+            } else {
+                send_card_frames(cards_, changed_);
+            }
+            merge_card_frames(written_, changed_);
+            changed_.present = 0;
+        }
+    }
+
+    void write_snapshot(const FrameSnapshot& snapshot) {
+        for (size_t card = 0; card < cards_.size() && card < snapshot.frames.size(); card++) {
+            bool updated = snapshot.update[card] != updated_[card];
+            bool forced = snapshot.force[card] != forced_[card];
+            updated_[card] = snapshot.update[card];
+            forced_[card] = snapshot.force[card];
+            if (!snapshot.frames.has(card) || !(updated || forced)) continue;
+            fading_ &= ~(1 << card);
+            if (snapshot.fade_ms[card] > 0 && !forced) {
+                fade_card(card, snapshot.frames.frames[card], snapshot.fade_ms[card]);
+            } else {
+                queue_card(card, snapshot.frames.frames[card], forced);
+            }
+        }
+        flush();
+    }
+
+    // Seqlock read: an odd or moved seq means a client was writing. It rings
+    // the doorbell once it is done, so a torn read is simply retried then.
+    void write_shared() {
+        uint32_t seq = shared_->seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            recover_shared(seq);
+            return;
+        }
+        stuck_seq_ = 0;
+        if (seq == shared_seq_) return;
+
+        uint8_t valid[MAX_CARDS];
+        LEDFrame frames[MAX_CARDS];
+        memcpy(valid, shared_->valid, sizeof(valid));
+        memcpy(frames, shared_->frames, sizeof(frames));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shared_->seq.load(std::memory_order_relaxed) != seq) return;
+        shared_seq_ = seq;
+
+        for (size_t card = 0; card < cards_.size() && card < shared_->num_cards; card++) {
+            if (!valid[card]) continue;
+            if (!shared_valid_[card] || !same_frame(shared_frames_[card], frames[card])) {
+                fading_ &= ~(1 << card);
+                queue_card(card, frames[card], false);
+                g_metrics.shared_updates.add();
+            }
+            shared_valid_[card] = 1;
+            shared_frames_[card] = frames[card];
+        }
+        flush();
+    }
+
+    CardList& cards_;
+    CardFrames written_;
+    CardFrames changed_;
+    uint32_t updated_[MAX_CARDS];
+    uint32_t forced_[MAX_CARDS];
+    bool fifo_;
+
+    Transition transitions_[MAX_CARDS];
+    uint8_t fading_ = 0; // bit n: card n has a fade running
+    uint8_t offline_ = 0; // bit n: card n was removed
+    std::atomic<uint8_t> removed_{0};
+    std::atomic<uint8_t> added_{0};
+    std::atomic<uint8_t> resend_{0};
+    uint64_t step_ns_;
+    uint64_t next_step_ns_ = 0;
+
+    // What the writer last took from the shared region
+    SharedFrames* shared_;
+    uint32_t shared_seq_ = 0;
+    uint32_t stuck_seq_ = 0; // odd seq last seen (0 for none), and since when
+    uint64_t stuck_since_ = 0;
+    uint8_t shared_valid_[MAX_CARDS] = {};
+    LEDFrame shared_frames_[MAX_CARDS];
+
+    FrameMailbox mailbox_;
+    FrameRing ring_;
+    alignas(64) std::atomic<uint32_t> local_doorbell_{0};
+    std::atomic<uint32_t> local_waiting_{0};
+    std::atomic<uint32_t>& doorbell_;
+    std::atomic<uint32_t>& writer_waiting_;
+    alignas(64) std::atomic<uint32_t> consumed_{0};
+    std::atomic<bool> producer_waiting_{false};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+// Daemon client connection with its partially received request line
+struct DaemonClient {
+    int fd;
+    std::string buffer;
+    std::string output; // replies the socket has not taken yet
+
+    explicit DaemonClient(int f) : fd(f) {}
+};
+
+/**
+ * A named layer of daemon requests, so several clients can share the LEDs
+ * without overwriting each other. A layer covers only the LEDs in leds[card];
+ * the rest show through from the layers beneath it and, at the bottom, from
+ * the requests without a layer. Layers are stacked by priority (a layer
+ * updated later goes above others of the same priority) and blended in with
+ * their opacity.
+ */
+struct DaemonLayer {
+    char name[DAEMON_LAYER_NAME_MAX + 1];
+    uint8_t priority;
+    uint8_t opacity;
+    uint64_t expires_ns;     // 0 for a layer without a TTL
+    uint8_t leds[MAX_CARDS]; // bit n: LED n of the card is in the layer
+    LEDFrame frames[MAX_CARDS];
+
+    DaemonLayer() : priority(DAEMON_LAYER_PRIORITY), opacity(MAX_OPACITY), expires_ns(0) {
+        name[0] = '\0';
+        memset(leds, 0, sizeof(leds));
+    }
+    uint8_t cards() const {
+        uint8_t mask = 0;
+        for (int card = 0; card < MAX_CARDS; card++) {
+            if (leds[card]) mask |= 1 << card;
+        }
+        return mask;
+    }
+};
+
+// Everything the daemon keeps between requests. desired is what the socket
+// requests without a layer have asked for so far, shown the composited
+// frames last handed to the writer.
+struct DaemonState {
+    CardList& cards;
+    FrameWriter& writer;
+    CardFrames desired;
+    CardFrames shown;
+    DaemonLayer layers[DAEMON_MAX_LAYERS]; // lowest first
+    int num_layers = 0;
+    uint32_t update[MAX_CARDS];
+    uint32_t force[MAX_CARDS];
+    uint32_t fade_ms[MAX_CARDS];
+    uint8_t brightness;
+    uint32_t default_fade_ms; // for requests without --fade
+    bool shared; // other processes also write frames
+    bool fifo;   // every request is its own frame
+    FrameSnapshot snapshot;
+
+    // Cards changed since the last flush, with the fade of their latest change
+    uint8_t pending = 0;
+    uint8_t forced = 0;
+    uint32_t pending_fade_ms[MAX_CARDS];
+
+    DaemonState(CardList& c, FrameWriter& w, const CardFrames& d, uint8_t b, uint32_t f, bool s, bool q)
+        : cards(c), writer(w), desired(d), shown(d), brightness(b), default_fade_ms(f), shared(s), fifo(q) {
+        memset(update, 0, sizeof(update));
+        memset(force, 0, sizeof(force));
+        memset(fade_ms, 0, sizeof(fade_ms));
+        memset(pending_fade_ms, 0, sizeof(pending_fade_ms));
+    }
+};
+
+// Blend the LED of top over the one in frame, in perceptual space like the fades
+void blend_led(LEDFrame& frame, int led, const LEDFrame& top, uint8_t opacity) {
+    if (opacity == MAX_OPACITY) {
+        frame.colors[led] = top.colors[led];
+        frame.brightness[led] = top.brightness[led];
+        return;
+    }
+    const FadeTables& tables = fade_tables();
+    auto mix = [opacity](uint8_t a, uint8_t b, const uint8_t* encode, const uint8_t* decode) {
+        return decode[(encode[a] * (MAX_OPACITY - opacity) + encode[b] * opacity) / MAX_OPACITY];
+    };
+    RGB& color = frame.colors[led];
+    const RGB& over = top.colors[led];
+    color.red = mix(color.red, over.red, tables.gamma_encode, tables.gamma_decode);
+    color.green = mix(color.green, over.green, tables.gamma_encode, tables.gamma_decode);
+    color.blue = mix(color.blue, over.blue, tables.gamma_encode, tables.gamma_decode);
+    frame.brightness[led] = mix(frame.brightness[led], top.brightness[led], tables.lightness_encode,
+                                tables.lightness_decode);
+}
+
+// What the LEDs should show: the requests without a layer, then every layer on top
+void composite_layers(const DaemonState& state, CardFrames& frames) {
+    frames = state.desired;
+    for (int i = 0; i < state.num_layers; i++) {
+        const DaemonLayer& layer = state.layers[i];
+        for (size_t card = 0; card < frames.size(); card++) {
+            if (!layer.leds[card]) continue;
+            if (!frames.has(card)) frames.set(card, LEDFrame());
+            for (int led = 0; led < NUM_LEDS; led++) {
+                if ((layer.leds[card] >> led) & 0x01) {
+                    blend_led(frames.frames[card], led, layer.frames[card], layer.opacity);
+                }
+            }
+        }
+    }
+}
+
+// Note cards whose composited frame may have changed; flush_daemon_frames() writes them
+void stage_daemon_cards(DaemonState& state, uint8_t cards, bool force, uint32_t fade_ms) {
+    state.pending |= cards;
+    if (force) state.forced |= cards;
+    for (int card = 0; card < MAX_CARDS; card++) {
+        if ((cards >> card) & 0x01) state.pending_fade_ms[card] = fade_ms;
+    }
+}
+
+/**
+ * Composite the layers and hand the cards that changed to the writer, once
+ * for everything the clients sent since the last flush. Cards that would show
+ * what they already show are skipped, unless forced or the shared region may
+ * have changed the LEDs since.
+ */
+void flush_daemon_frames(DaemonState& state) {
+    if (!state.pending) {
+        return;
+    }
+    CardFrames frames;
+    composite_layers(state, frames);
+
+    bool changed = false;
+    for (size_t card = 0; card < frames.size(); card++) {
+        if (!((state.pending >> card) & 0x01)) continue;
+        // A card left with neither a layer nor a frame of its own goes dark,
+        // rather than keeping the layer that was dropped or expired
+        if (!frames.has(card)) {
+            if (!state.shown.has(card)) continue;
+            frames.set(card, LEDFrame());
+        }
+        bool forced = (state.forced >> card) & 0x01;
+        if (!forced && !state.shared && state.shown.has(card) &&
+            same_frame(frames.frames[card], state.shown.frames[card])) {
+            continue;
+        }
+        state.update[card]++;
+        state.fade_ms[card] = state.pending_fade_ms[card];
+        if (forced) state.force[card]++;
+        changed = true;
+    }
+    state.pending = 0;
+    state.forced = 0;
+    if (!changed) {
+        return;
+    }
+
+    state.shown = frames;
+    make_snapshot(state.shown, state.update, state.force, state.fade_ms, state.snapshot);
+    state.writer.submit(state.snapshot);
+}
+
+// Record frames requested without a layer
+void commit_daemon_frames(DaemonState& state, const CardFrames& request, bool force, uint32_t fade_ms) {
+    merge_card_frames(state.desired, request);
+    stage_daemon_cards(state, request.present, force, fade_ms);
+    if (state.fifo) flush_daemon_frames(state);
+}
+
+int find_daemon_layer(const DaemonState& state, const char* name) {
+    for (int i = 0; i < state.num_layers; i++) {
+        if (strcmp(state.layers[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+void remove_daemon_layer(DaemonState& state, int index, uint32_t fade_ms) {
+    stage_daemon_cards(state, state.layers[index].cards(), false, fade_ms);
+    memmove(&state.layers[index], &state.layers[index + 1], (state.num_layers - index - 1) * sizeof(DaemonLayer));
+    state.num_layers--;
+}
+
+// The named layer at its place in the stack for priority, created if needed;
+// nullptr if there is no room for another layer
+DaemonLayer* place_daemon_layer(DaemonState& state, const char* name, uint8_t priority) {
+    int index = find_daemon_layer(state, name);
+    DaemonLayer layer;
+    if (index >= 0) {
+        layer = state.layers[index];
+        memmove(&state.layers[index], &state.layers[index + 1],
+                (state.num_layers - index - 1) * sizeof(DaemonLayer));
+        state.num_layers--;
+    } else if (state.num_layers == DAEMON_MAX_LAYERS) {
+        return nullptr;
+    } else {
+        snprintf(layer.name, sizeof(layer.name), "%s", name);
+    }
+    layer.priority = priority;
+
+    int pos = state.num_layers;
+    while (pos > 0 && state.layers[pos - 1].priority > priority) pos--;
+    memmove(&state.layers[pos + 1], &state.layers[pos], (state.num_layers - pos) * sizeof(DaemonLayer));
+    state.layers[pos] = layer;
+    state.num_layers++;
+    return &state.layers[pos];
+}
+
+// Drop the layers whose TTL ran out. Returns when the next one expires, 0 for never.
+uint64_t expire_daemon_layers(DaemonState& state, uint64_t now) {
+    uint64_t next = 0;
+    for (int i = state.num_layers; i-- > 0;) {
+        uint64_t expires = state.layers[i].expires_ns;
+        if (expires == 0) continue;
+        if (expires <= now) {
+            remove_daemon_layer(state, i, state.default_fade_ms);
+        } else if (next == 0 || expires < next) {
+            next = expires;
+        }
+    }
+    return next;
+}
+
+int create_daemon_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Refuse to take over the socket of a daemon that is still running
+    ScopedFD probe(connect_daemon_socket(path));
+    if (probe.get() >= 0) {
+        fprintf(stderr, "Error: Another daemon is already listening on %s\n", path);
+        return -1;
+    }
+    unlink(path);
+
+    ScopedFD sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (sock.get() < 0) {
+        perror("Failed to create daemon socket");
+        return -1;
+    }
+    if (bind(sock.get(), (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Failed to bind daemon socket");
+        return -1;
+    }
+    // LED colors are harmless, so any local user may submit frames
+    chmod(path, 0666);
+    if (listen(sock.get(), DAEMON_MAX_CLIENTS) < 0) {
+        perror("Failed to listen on daemon socket");
+        unlink(path);
+        return -1;
+    }
+    return sock.release();
+}
+
+// Settings of a request that goes to a layer; the ones not given (-1) keep
+// the layer's current value, or the default for a new layer
+struct LayerOptions {
+    const char* name = nullptr;
+    int priority = -1;
+    int opacity = -1;
+    int64_t ttl_ms = -1; // 0 keeps the layer until dropped
+    bool drop = false;
+};
+
+bool parse_layer_value(const char* str, unsigned max, unsigned& value) {
+    return scan_number(str, max, value) && *str == '\0';
+}
+
+// Set the LEDs of a layer, or just its settings if the request has no frame
+bool handle_layer_request(DaemonState& state, const LayerOptions& options, int argc, char* argv[], bool force,
+                          uint8_t brightness, uint32_t fade_ms) {
+    int index = find_daemon_layer(state, options.name);
+    if (options.drop) {
+        if (argc > 1) {
+            fprintf(stderr, "Error: --drop takes no frame\n");
+            return false;
+        }
+        if (index >= 0) remove_daemon_layer(state, index, fade_ms);
+        return true;
+    }
+
+    FrameRequest parsed;
+    CardFrames request(state.cards.size());
+    if (argc > 1 && (!parse_led_configs(argc, argv, parsed) ||
+                     !build_card_frames(parsed, state.cards.size(), brightness, request))) {
+        return false;
+    }
+
+    uint8_t before = index >= 0 ? state.layers[index].cards() : 0;
+    int priority = options.priority >= 0 ? options.priority
+                 : index >= 0 ? state.layers[index].priority : DAEMON_LAYER_PRIORITY;
+    DaemonLayer* layer = place_daemon_layer(state, options.name, priority);
+    if (!layer) {
+        fprintf(stderr, "Error: Too many layers (%d at most)\n", DAEMON_MAX_LAYERS);
+        return false;
+    }
+    if (options.opacity >= 0) layer->opacity = options.opacity;
+    if (options.ttl_ms >= 0) layer->expires_ns = options.ttl_ms ? monotonic_ns() + options.ttl_ms * 1000000ULL : 0;
+
+    // A request replaces the layer's LEDs on the cards it addresses
+    for (size_t card = 0; card < request.size(); card++) {
+        if (!request.has(card)) continue;
+        layer->leds[card] = parsed.present[0] | parsed.present[card + 1];
+        layer->frames[card] = request.frames[card];
+    }
+    stage_daemon_cards(state, before | layer->cards(), force, fade_ms);
+    if (state.fifo) flush_daemon_frames(state);
+    return true;
+}
+
+bool handle_parsed_request(DaemonState& state, int argc, char* argv[], bool force, uint8_t brightness,
+                           uint32_t fade_ms) {
+    FrameRequest parsed;
+    if (!parse_led_configs(argc, argv, parsed)) {
+        return false;
+    }
+
+    CardFrames request;
+    if (!build_card_frames(parsed, state.cards.size(), brightness, request)) {
+        return false;
+    }
+    commit_daemon_frames(state, request, force, fade_ms);
+    return true;
+}
+
+// Parse one request line (same syntax as the command line) and write the frame
+bool handle_daemon_request(DaemonState& state, std::string& line) {
+    char* args[DAEMON_MAX_ARGS + 1];
+    int count = split_request_args(&line[0], args, DAEMON_MAX_ARGS);
+    if (count < 0) {
+        fprintf(stderr, "Error: Too many arguments in request\n");
+        return false;
+    }
+
+    // Requests may start with --force, --brightness <n> and --fade <ms>, like the
+    // command line, and with the layer options
+    bool force = false;
+    uint8_t brightness = state.brightness;
+    uint32_t fade_ms = state.default_fade_ms;
+    LayerOptions layer;
+    bool layer_settings = false;
+    unsigned value;
+    int first = 1;
+    for (; first < count && strncmp(args[first], "--", 2) == 0; first++) {
+        if (strcmp(args[first], "--force") == 0) {
+            force = true;
+        } else if (strcmp(args[first], "--brightness") == 0 && first + 1 < count &&
+                   parse_brightness(args[first + 1], brightness)) {
+            first++;
+        } else if (strcmp(args[first], "--fade") == 0 && first + 1 < count &&
+                   parse_fade(args[first + 1], fade_ms)) {
+            first++;
+        } else if (strcmp(args[first], "--layer") == 0 && first + 1 < count && parse_layer_name(args[first + 1])) {
+            layer.name = args[++first];
+        } else if (strcmp(args[first], "--priority") == 0 && first + 1 < count &&
+                   parse_layer_value(args[first + 1], 255, value)) {
+            layer.priority = value;
+            layer_settings = true;
+            first++;
+        } else if (strcmp(args[first], "--opacity") == 0 && first + 1 < count &&
+                   parse_layer_value(args[first + 1], MAX_OPACITY, value)) {
+            layer.opacity = value;
+            layer_settings = true;
+            first++;
+        } else if (strcmp(args[first], "--ttl") == 0 && first + 1 < count &&
+                   parse_layer_value(args[first + 1], DAEMON_MAX_TTL_MS, value)) {
+            layer.ttl_ms = value;
+            layer_settings = true;
+            first++;
+        } else if (strcmp(args[first], "--drop") == 0) {
+            layer.drop = true;
+            layer_settings = true;
+        } else {
+            fprintf(stderr, "Error: Invalid request option: %s\n", args[first]);
+            return false;
+        }
+    }
+    if (layer_settings && !layer.name) {
+        fprintf(stderr, "Error: --priority, --opacity, --ttl and --drop need --layer\n");
+        return false;
+    }
+
+    // Keep the program name slot in front of the frame arguments
+    args[first - 1] = args[0];
+    if (layer.name) {
+        return handle_layer_request(state, layer, count - first + 1, args + first - 1, force, brightness, fade_ms);
+    }
+    return handle_parsed_request(state, count - first + 1, args + first - 1, force, brightness, fade_ms);
+}
+
+// A card's frame in the request syntax, e.g. "0:0:#ff0000@255 0:1:..."
+std::string format_card_frame(size_t card, const LEDFrame& frame) {
+    std::string line;
+    for (int led = 0; led < NUM_LEDS; led++) {
+        char token[32];
+        const RGB& color = frame.colors[led];
+        snprintf(token, sizeof(token), "%s%zu:%d:#%02x%02x%02x@%u", led ? " " : "", card, led, color.red,
+                 color.green, color.blue, frame.brightness[led]);
+        line += token;
+    }
+    return line;
+}
+
+/**
+ * Send as much of a client's replies as its socket takes without blocking,
+ * so a client that stops reading never stalls the event loop. False once
+ * more than DAEMON_MAX_BACKLOG bytes are waiting or the socket failed.
+ */
+bool flush_daemon_client(DaemonClient& client) {
+    while (!client.output.empty()) {
+        ssize_t n = send(client.fd, client.output.data(), client.output.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        client.output.erase(0, n);
+    }
+    if (client.output.size() > DAEMON_MAX_BACKLOG) {
+        fprintf(stderr, "Error: Client does not read its replies, dropping it\n");
+        return false;
+    }
+    return true;
+}
+
+// Read pending data from a client and handle every complete line
+bool service_daemon_client(DaemonState& state, DaemonClient& client) {
+    char buf[512];
+    ssize_t n = read(client.fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    client.buffer.append(buf, n);
+
+    size_t pos;
+    while ((pos = client.buffer.find('\n')) != std::string::npos) {
+        std::string line = client.buffer.substr(0, pos);
+        client.buffer.erase(0, pos + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+        // "stats" returns the metrics in the Prometheus text format, then OK
+        std::string trimmed = line.substr(0, line.find_last_not_of(" \t\r") + 1);
+        if (trimmed == "stats") {
+            client.output += format_metrics(state.cards) + "OK\n";
+            continue;
+        }
+        // "cards" returns the number of cards, then OK
+        if (trimmed == "cards") {
+            client.output += std::to_string(state.cards.size()) + "\nOK\n";
+            continue;
+        }
+        // "frame [card [base]]" returns the composited frame of a card (default 0),
+        // or with base the frame requested without a layer, then OK
+        if (trimmed == "frame" || trimmed.compare(0, 6, "frame ") == 0) {
+            char* endptr = &trimmed[0] + trimmed.size();
+            unsigned long card = trimmed.size() > 6 ? strtoul(trimmed.c_str() + 6, &endptr, 10) : 0;
+            bool base = strcmp(endptr, " base") == 0;
+            if ((*endptr == '\0' || base) && card < state.cards.size()) {
+                const CardFrames& frames = base ? state.desired : state.shown;
+                LEDFrame frame = frames.has(card) ? frames.frames[card] : LEDFrame();
+                client.output += format_card_frame(card, frame) + "\nOK\n";
+            } else {
+                client.output += "ERR\n";
+            }
+            continue;
+        }
+
+        g_metrics.requests.add();
+        bool ok = handle_daemon_request(state, line);
+        if (!ok) g_metrics.request_errors.add();
+        client.output += ok ? "OK\n" : "ERR\n";
+    }
+
+    if (client.buffer.size() > DAEMON_MAX_LINE) {
+        fprintf(stderr, "Error: Request too long, dropping client\n");
+        return false;
+    }
+    return flush_daemon_client(client);
+}
+
+// Kernel uevents (not udev's copies, so udev need not run); -1 with a warning
+// if they can't be had, in which case the daemon just doesn't follow hotplug
+int open_uevent_socket() {
+    ScopedFD sock(socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT));
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (sock.get() < 0 || bind(sock.get(), (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Warning: Not following PCI hotplug events");
+        return -1;
+    }
+    return sock.release();
+}
+
+/**
+ * Pass uevents about the cards on to the writer. A removed card is skipped
+ * until it is added back; on add or on a driver bind (which may reset the
+ * LED controller) the card is probed and mapped again and sent its frame.
+ */
+void handle_uevents(int fd, const CardList& cards, FrameWriter& writer) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        const char* action = nullptr;
+        const char* subsystem = nullptr;
+        const char* slot = nullptr;
+        for (const char* p = buf; p < buf + n; p += strlen(p) + 1) {
+            if (strncmp(p, "ACTION=", 7) == 0) action = p + 7;
+            else if (strncmp(p, "SUBSYSTEM=", 10) == 0) subsystem = p + 10;
+            else if (strncmp(p, "PCI_SLOT_NAME=", 14) == 0) slot = p + 14;
+        }
+        if (!action || !subsystem || !slot || strcmp(subsystem, "pci") != 0) continue;
+
+        for (size_t card = 0; card < cards.size(); card++) {
+            if (cards[card]->device.bdf != slot) continue;
+            if (strcmp(action, "remove") == 0) {
+                fprintf(stderr, "Card %zu (%s) was removed\n", card, slot);
+                writer.card_removed(card);
+            } else if (strcmp(action, "add") == 0 || strcmp(action, "bind") == 0) {
+                fprintf(stderr, "Card %zu (%s) is back (%s), mapping it again\n", card, slot, action);
+                writer.card_added(card);
+            }
+        }
+    }
+}
+
+// A timer that the kernel cancels whenever the wall clock jumps, which
+// includes every resume. It is set far in the future, so it never fires.
+bool arm_resume_timer(int fd) {
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = INT_MAX;
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timer, nullptr) == 0;
+}
+
+int run_daemon(CardList& cards, const char* socket_path, const char* state_path,
+               uint8_t brightness, const CardFrames* initial, bool fifo, const char* shm_name, gid_t shm_group,
+               const char* metrics_path, uint32_t fade_ms, int fps) {
+    ScopedFD listen_fd(create_daemon_socket(socket_path));
+    if (listen_fd.get() < 0) {
+        return 1;
+    }
+
+    // The daemon tracks the frames in memory. Drop the state file while it runs so
+    // one-shot invocations never skip a write based on a frame it has replaced.
+    CardFrames saved;
+    if (!load_frame_state(state_path, saved) || saved.size() != cards.size()) {
+        saved = CardFrames(cards.size());
+    }
+    SharedFrames* shared = nullptr;
+    if (shm_name) {
+        shared = create_shared_frames(shm_name, shm_group, saved);
+        if (!shared) {
+            unlink(socket_path);
+            return 1;
+        }
+    }
+    FrameWriter writer(cards, saved, fifo, shared, 1000000000ULL / fps);
+    DaemonState state(cards, writer, saved, brightness, fade_ms, shared != nullptr, fifo);
+    if (state_path) {
+        unlink(state_path);
+    }
+    if (initial) {
+        commit_daemon_frames(state, *initial, false, fade_ms);
+        flush_daemon_frames(state);
+    }
+
+    // The LEDs lose their frame in suspend, and the cards are mapped only once
+    ScopedFD uevent_fd(open_uevent_socket());
+    ScopedFD resume_fd(timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK));
+    if (resume_fd.get() >= 0 && !arm_resume_timer(resume_fd.get())) {
+        resume_fd.reset(-1);
+    }
+    uint64_t slept_ns = suspended_ns();
+
+    install_stop_handlers();
+    fprintf(stderr, "Listening on %s\n", socket_path);
+    if (shm_name) {
+        fprintf(stderr, "Sharing frames in /dev/shm%s\n", shm_name);
+    }
+
+    std::vector<DaemonClient> clients;
+    std::vector<struct pollfd> fds;
+    uint64_t next_metrics = monotonic_ns();
+    while (!g_stop_requested) {
+        // One composited frame for everything handled since the last pass
+        uint64_t next_expiry = expire_daemon_layers(state, monotonic_ns());
+        flush_daemon_frames(state);
+
+        fds.clear();
+        fds.push_back({listen_fd.get(), POLLIN, 0});
+        for (const auto& client : clients) {
+            fds.push_back({client.fd, (short)(client.output.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+        }
+        size_t uevent_index = fds.size();
+        fds.push_back({uevent_fd.get(), POLLIN, 0});
+        fds.push_back({resume_fd.get(), POLLIN, 0});
+
+        // Wake up for the metrics file even when no client is active
+        int timeout = -1;
+        if (metrics_path) {
+            uint64_t now = monotonic_ns();
+            timeout = now >= next_metrics ? 0 : (int)((next_metrics - now) / 1000000) + 1;
+        }
+        if (next_expiry) {
+            uint64_t now = monotonic_ns();
+            int expiry_timeout = now >= next_expiry ? 0 : (int)((next_expiry - now) / 1000000) + 1;
+            if (timeout < 0 || expiry_timeout < timeout) timeout = expiry_timeout;
+        }
+        int ready = poll(fds.data(), fds.size(), timeout);
+        if (metrics_path && monotonic_ns() >= next_metrics) {
+            write_metrics_file(metrics_path, cards);
+            next_metrics = monotonic_ns() + METRICS_INTERVAL_MS * 1000000ULL;
+        }
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[uevent_index].revents & POLLIN) {
+            handle_uevents(uevent_fd.get(), cards, writer);
+        }
+        if (fds[uevent_index + 1].revents & POLLIN) {
+            // The read fails with ECANCELED; a jump without a suspend is just a clock change
+            uint64_t expirations;
+            ssize_t ignored = read(resume_fd.get(), &expirations, sizeof(expirations));
+            (void)ignored;
+            arm_resume_timer(resume_fd.get());
+            uint64_t now_slept = suspended_ns();
+            if (now_slept > slept_ns + SUSPEND_SLACK_NS) {
+                fprintf(stderr, "Resumed from suspend, sending the frames again\n");
+                g_metrics.resumes.add();
+                writer.resend((1 << cards.size()) - 1);
+            }
+            slept_ns = now_slept;
+        }
+
+        for (size_t i = 0; i < clients.size(); i++) {
+            short revents = fds[i + 1].revents;
+            if (revents == 0) continue;
+            bool ok = !(revents & POLLOUT) || flush_daemon_client(clients[i]);
+            if (!ok || ((revents & ~POLLOUT) && !service_daemon_client(state, clients[i]))) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+        for (size_t i = clients.size(); i-- > 0;) {
+            if (clients[i].fd < 0) clients.erase(clients.begin() + i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd.get(), nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0) {
+                perror("accept");
+            } else if (clients.size() >= DAEMON_MAX_CLIENTS) {
+                close(fd);
+            } else {
+                clients.emplace_back(fd);
+            }
+        }
+    }
+
+    for (const auto& client : clients) {
+        close(client.fd);
+    }
+    unlink(socket_path);
+    writer.stop();
+    if (shared) {
+        destroy_shared_frames(shm_name, shared);
+    }
+    save_frame_state(state_path, writer.written());
+    write_metrics_file(metrics_path, cards);
+    print_write_stats(cards);
+    return 0;
+}
+
+enum EffectType {
+    EFFECT_BREATHE,
+    EFFECT_PULSE,
+    EFFECT_CYCLE,
+    EFFECT_KEYFRAMES,
+    EFFECT_SHOW
+};
+
+// One point of a keyframe show; colors are interpolated between keyframes
+struct Keyframe {
+    uint64_t time_ms;
+    LEDFrame frame;
+    FrameSoA soa; // frame in perceptual space, for blending
+};
+
+/**
+ * Description of an animation. Parametric effects use color and period_ms,
+ * keyframe shows loop over their keyframes and recorded shows over the
+ * frames of a mapped show file.
+ */
+struct Effect {
+    EffectType type;
+    RGB color;
+    uint8_t brightness;
+    uint64_t period_ms;
+    std::vector<Keyframe> keyframes;
+    const uint8_t* show;
+    size_t show_frames;
+    int show_fps;
+
+    Effect()
+        : type(EFFECT_BREATHE), brightness(MAX_BRIGHTNESS), period_ms(EFFECT_DEFAULT_PERIOD_MS),
+          show(nullptr), show_frames(0), show_fps(0) {}
+};
+
+/**
+ * Header of a show file, 8 bytes. The fps is little-endian; the LED count
+ * must be NUM_LEDS. The frames follow without any framing, so their count
+ * comes from the file size and a recording cut short is still a valid show.
+ */
+struct ShowHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t leds;
+    uint8_t fps[2];
+};
+
+static_assert(sizeof(ShowHeader) == 8, "show files start with an 8-byte header");
+
+bool parse_milliseconds(const char* str, uint64_t& ms) {
+    char* endptr;
+    errno = 0;
+    long long value = strtoll(str, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || value < 0) return false;
+    ms = value;
+    return true;
+}
+
+bool parse_period(const char* str, uint64_t& period_ms) {
+    return parse_milliseconds(str, period_ms) && period_ms > 0;
+}
+
+// Parse <name>[:<r,g,b>][:<period_ms>]
+bool parse_effect(const char* spec, Effect& effect) {
+    std::string copy(spec);
+    char* save = nullptr;
+    char* name = strtok_r(&copy[0], ":", &save);
+    char* first = strtok_r(nullptr, ":", &save);
+    char* second = strtok_r(nullptr, ":", &save);
+    if (!name || strtok_r(nullptr, ":", &save)) return false;
+
+    if (strcmp(name, "cycle") == 0) {
+        effect.type = EFFECT_CYCLE;
+        return !second && (!first || parse_period(first, effect.period_ms));
+    }
+
+    if (strcmp(name, "breathe") == 0) {
+        effect.type = EFFECT_BREATHE;
+    } else if (strcmp(name, "pulse") == 0) {
+        effect.type = EFFECT_PULSE;
+    } else {
+        return false;
+    }
+    return first && parse_color(first, effect.color) &&
+           (!second || parse_period(second, effect.period_ms));
+}
+
+// Cut a line at its comment: the first '#' that is not a #rrggbb color
+// ending at a blank, an '@' brightness or the end of the line
+void strip_comment(char* line) {
+    for (char* hash = strchr(line, '#'); hash; hash = strchr(hash + 1, '#')) {
+        const char* p = hash;
+        RGB color;
+        if (scan_color(p, color) && (*p == '\0' || *p == '@' || is_blank(*p))) continue;
+        *hash = '\0';
+        return;
+    }
+}
+
+// Keyframe files hold lines of "<time_ms> <frame>" with '#' comments.
+// LEDs without their own brightness use the effect's brightness.
+bool load_keyframes(const char* path, Effect& effect) {
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open keyframe file %s\n", path);
+        return false;
+    }
+
+    effect.type = EFFECT_KEYFRAMES;
+    char line[DAEMON_MAX_LINE + 2];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        size_t length = strcspn(line, "\n");
+        if (line[length] != '\n' && !feof(file)) {
+            fprintf(stderr, "Error: Keyframe line too long at %s:%d\n", path, line_number);
+            ok = false;
+            break;
+        }
+        line[length] = '\0';
+        strip_comment(line);
+
+        char* args[DAEMON_MAX_ARGS + 1];
+        int count = split_request_args(line, args, DAEMON_MAX_ARGS);
+        if (count == 1) continue;
+
+        // The time takes the place of the program name for the frame parser
+        Keyframe keyframe;
+        FrameRequest request;
+        if (count < 3 || !parse_milliseconds(args[1], keyframe.time_ms) ||
+            !parse_led_configs(count - 1, args + 1, request)) {
+            fprintf(stderr, "Error: Invalid keyframe at %s:%d\n", path, line_number);
+            ok = false;
+            break;
+        }
+        if (!effect.keyframes.empty() && keyframe.time_ms <= effect.keyframes.back().time_ms) {
+            fprintf(stderr, "Error: Keyframe times must increase at %s:%d\n", path, line_number);
+            ok = false;
+            break;
+        }
+
+        // Shows are played on every card alike
+        if (highest_card(request) >= 0) {
+            fprintf(stderr, "Error: Keyframes cannot address a single card at %s:%d\n", path, line_number);
+            ok = false;
+            break;
+        }
+
+        build_frame(request, -1, effect.brightness, keyframe.frame);
+        encode_soa(keyframe.frame, keyframe.soa);
+        effect.keyframes.push_back(keyframe);
+    }
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+
+    if (effect.keyframes.empty()) {
+        fprintf(stderr, "Error: No keyframes in %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Map a show file for playback. Nothing is parsed or copied: each frame is
+ * read from the mapping when it is due, and the kernel can drop pages that
+ * have been played, so startup and memory don't grow with the show.
+ */
+bool map_show(const char* path, Effect& effect, ScopedMMIO& mapping) {
+    ScopedFD fd(open(path, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd.get() < 0 || fstat(fd.get(), &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (st.st_size < (off_t)(sizeof(ShowHeader) + SHOW_FRAME_SIZE)) {
+        fprintf(stderr, "Error: %s is not a show file or has no frames\n", path);
+        return false;
+    }
+
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (base == MAP_FAILED) {
+        perror("Error: Cannot map the show");
+        return false;
+    }
+    mapping.reset(base, st.st_size);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    const ShowHeader* header = (const ShowHeader*)base;
+    int fps = header->fps[0] | header->fps[1] << 8;
+    if (memcmp(header->magic, SHOW_MAGIC, sizeof(header->magic)) != 0 || header->version != SHOW_VERSION) {
+        fprintf(stderr, "Error: %s is not a show file\n", path);
+        return false;
+    }
+    if (header->leds != NUM_LEDS || fps <= 0 || fps > EFFECT_MAX_FPS) {
+        fprintf(stderr, "Error: %s has %d LEDs at %d fps, expected %d LEDs at 1-%d fps\n",
+                path, header->leds, fps, NUM_LEDS, EFFECT_MAX_FPS);
+        return false;
+    }
+
+    effect.type = EFFECT_SHOW;
+    effect.show = (const uint8_t*)base + sizeof(ShowHeader);
+    effect.show_frames = (st.st_size - sizeof(ShowHeader)) / SHOW_FRAME_SIZE;
+    effect.show_fps = fps;
+    return true;
+}
+
+void render_show(const Effect& effect, uint64_t elapsed_ns, LEDFrame& frame) {
+    // Rounded, as the frame period in whole nanoseconds runs a little short
+    uint64_t index = (elapsed_ns * effect.show_fps + 500000000ULL) / 1000000000ULL % effect.show_frames;
+    const uint8_t* colors = effect.show + index * SHOW_FRAME_SIZE;
+    for (int led = 0; led < NUM_LEDS; led++) {
+        frame.colors[led] = RGB(colors[led * 3], colors[led * 3 + 1], colors[led * 3 + 2]);
+    }
+}
+
+RGB scale_color(const RGB& color, double intensity) {
+    return RGB(color.red * intensity, color.green * intensity, color.blue * intensity);
+}
+
+// Fully saturated color for a hue in [0, 1)
+RGB hue_to_rgb(double hue) {
+    double h = hue * 6.0;
+    int sector = (int)h % 6;
+    uint8_t rising = (h - floor(h)) * 255;
+    uint8_t falling = 255 - rising;
+    switch (sector) {
+        case 0: return RGB(255, rising, 0);
+        case 1: return RGB(falling, 255, 0);
+        case 2: return RGB(0, 255, rising);
+        case 3: return RGB(0, falling, 255);
+        case 4: return RGB(rising, 0, 255);
+        default: return RGB(255, 0, falling);
+    }
+}
+
+void render_keyframes(const std::vector<Keyframe>& keyframes, uint64_t elapsed_ms, LEDFrame& frame) {
+    // The show loops once the last keyframe is reached
+    uint64_t length = keyframes.back().time_ms;
+    uint64_t t = length > 0 ? elapsed_ms % length : 0;
+
+    size_t next = 0;
+    while (next < keyframes.size() && keyframes[next].time_ms <= t) {
+        next++;
+    }
+    if (next == 0 || next == keyframes.size()) {
+        // Before the first keyframe or on a single-keyframe show
+        const Keyframe& only = next == 0 ? keyframes.front() : keyframes.back();
+        frame = only.frame;
+        return;
+    }
+
+    const Keyframe& a = keyframes[next - 1];
+    const Keyframe& b = keyframes[next];
+    uint32_t fraction = (t - a.time_ms) * 256 / (b.time_ms - a.time_ms);
+    if (fraction == 0) {
+        frame = a.frame;
+        return;
+    }
+    FrameSoA step;
+    lerp_soa(a.soa, b.soa, fraction, step);
+    decode_soa(step, frame);
+}
+
+void render_effect(const Effect& effect, uint64_t elapsed_ns, LEDFrame& frame) {
+    uint64_t elapsed_ms = elapsed_ns / 1000000;
+    double phase = (double)(elapsed_ms % effect.period_ms) / effect.period_ms;
+
+    if (effect.type != EFFECT_KEYFRAMES) {
+        memset(frame.brightness, effect.brightness, sizeof(frame.brightness));
+    }
+
+    switch (effect.type) {
+        case EFFECT_BREATHE: {
+            RGB color = scale_color(effect.color, (1.0 - cos(2.0 * M_PI * phase)) / 2.0);
+            for (int led = 0; led < NUM_LEDS; led++) frame.colors[led] = color;
+            break;
+        }
+        case EFFECT_PULSE: {
+            // Flash at the start of each period, then decay to off within a quarter of it
+            double intensity = phase < 0.25 ? 1.0 - phase * 4.0 : 0.0;
+            RGB color = scale_color(effect.color, intensity * intensity);
+            for (int led = 0; led < NUM_LEDS; led++) frame.colors[led] = color;
+            break;
+        }
+        case EFFECT_CYCLE:
+            for (int led = 0; led < NUM_LEDS; led++) {
+                double hue = phase + (double)led / NUM_LEDS;
+                frame.colors[led] = hue_to_rgb(hue - floor(hue));
+            }
+            break;
+        case EFFECT_KEYFRAMES:
+            render_keyframes(effect.keyframes, elapsed_ms, frame);
+            break;
+        case EFFECT_SHOW:
+            render_show(effect, elapsed_ns, frame);
+            break;
+    }
+}
+
+/**
+ * Render and write effect frames at a fixed rate. Each frame has an absolute
+ * deadline; a frame that finishes after the next deadline counts as missed
+ * and the schedule skips ahead instead of trying to catch up.
+ */
+int run_effect(CardList& cards, const char* state_path, const char* metrics_path, const Effect& effect, int fps,
+               double duration_s) {
+    install_stop_handlers();
+
+    const uint64_t period_ns = 1000000000ULL / fps;
+    const uint64_t duration_ns = duration_s * 1e9;
+    const uint64_t start = monotonic_ns();
+    uint64_t deadline = start;
+    uint64_t frames = 0, written = 0, missed = 0, dropped = 0;
+    uint64_t next_metrics = start;
+
+    // Every card shows the same effect
+    CardFrames output(cards.size());
+    CardFrames last(cards.size());
+    output.set_all();
+
+    while (!g_stop_requested) {
+        uint64_t elapsed = deadline - start;
+        if (duration_ns > 0 && elapsed >= duration_ns) break;
+
+        render_effect(effect, elapsed, output.frames[0]);
+        for (size_t card = 1; card < cards.size(); card++) {
+            output.frames[card] = output.frames[0];
+        }
+        if (!frames_unchanged(output, last)) {
+            send_card_frames(cards, output);
+            merge_card_frames(last, output);
+            written++;
+        }
+        frames++;
+
+        deadline += period_ns;
+        uint64_t now = monotonic_ns();
+        if (now > deadline) {
+            missed++;
+            uint64_t behind = (now - deadline) / period_ns + 1;
+            dropped += behind;
+            deadline += behind * period_ns;
+            g_metrics.missed_deadlines.add();
+            g_metrics.dropped_frames.add(behind);
+        }
+        if (metrics_path && now >= next_metrics) {
+            write_metrics_file(metrics_path, cards);
+            next_metrics = now + METRICS_INTERVAL_MS * 1000000ULL;
+        }
+
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && !g_stop_requested) {}
+    }
+
+    save_frame_state(state_path, last);
+    write_metrics_file(metrics_path, cards);
+    fprintf(stderr, "Effect: %llu frames (%llu written), %llu missed deadlines, %llu frames dropped\n",
+            (unsigned long long)frames, (unsigned long long)written,
+            (unsigned long long)missed, (unsigned long long)dropped);
+    print_write_stats(cards);
+    return 0;
+}
+
+/**
+ * Band-pass filter bank for the audio mode: one biquad per LED, from bass on
+ * LED 0 to treble on the last. Coefficients and state of all bands live in
+ * FRAME_LANES-wide arrays, so the per-sample update of every band is one
+ * loop the compiler vectorizes; the padding lanes have zero coefficients.
+ */
+struct FilterBank {
+    float b0[FRAME_LANES] = {}; // b1 is 0 and b2 is -b0 for a band-pass
+    float a1[FRAME_LANES] = {};
+    float a2[FRAME_LANES] = {};
+    float z1[FRAME_LANES] = {};
+    float z2[FRAME_LANES] = {};
+    float level[FRAME_LANES] = {}; // 0-1, falling back slowly after a peak
+
+    // RBJ band-pass with 0 dB peak gain, centers spaced two octaves apart
+    explicit FilterBank(double rate) {
+        for (int band = 0; band < NUM_LEDS; band++) {
+            double w0 = 2 * M_PI * AUDIO_LOWEST_BAND_HZ * pow(4.0, band) / rate;
+            double alpha = sin(w0) / (2 * AUDIO_BAND_Q);
+            b0[band] = alpha / (1 + alpha);
+            a1[band] = -2 * cos(w0) / (1 + alpha);
+            a2[band] = (1 - alpha) / (1 + alpha);
+        }
+    }
+
+    // Filter one period of interleaved samples and update the band levels
+    void process(const int16_t* samples, size_t frames, int channels) {
+        float energy[FRAME_LANES] = {};
+        for (size_t i = 0; i < frames; i++) {
+            float x = 0;
+            for (int c = 0; c < channels; c++) x += samples[i * channels + c];
+            x *= 1.0f / (32768.0f * channels);
+            for (int band = 0; band < FRAME_LANES; band++) {
+                float y = b0[band] * x + z1[band];
+                z1[band] = z2[band] - a1[band] * y;
+                z2[band] = -b0[band] * x - a2[band] * y;
+                energy[band] += y * y;
+            }
+        }
+
+        // RMS in dBFS onto 0-1; peaks show at once, the fall is exponential
+        const float release = exp(-(double)frames / AUDIO_RATE * 1000 / AUDIO_RELEASE_MS);
+        for (int band = 0; band < FRAME_LANES; band++) {
+            float db = 10 * log10f(energy[band] / frames + 1e-12f);
+            float now = std::min(1.0f, std::max(0.0f, 1 - db / AUDIO_FLOOR_DB));
+            level[band] = std::max(now, level[band] * release);
+        }
+    }
+};
+
+/**
+ * PCM input of the audio mode: a raw stream of interleaved S16_LE samples at
+ * AUDIO_RATE (a file, a FIFO or "-" for standard input, e.g. from arecord or
+ * pw-record) or, when built with -DAE5_WITH_ALSA and -lasound, an ALSA
+ * capture device such as "hw:1,0".
+ */
+class AudioInput {
+public:
+    ~AudioInput() {
+        if (fd_ > 0) close(fd_);
+#ifdef AE5_WITH_ALSA
+        if (pcm_) snd_pcm_close(pcm_);
+#endif
+    }
+
+    bool open(const char* source) {
+        if (strcmp(source, "-") == 0) {
+            fd_ = STDIN_FILENO;
+            return true;
+        }
+        struct stat st;
+        if (stat(source, &st) == 0) {
+            fd_ = ::open(source, O_RDONLY | O_CLOEXEC);
+            if (fd_ < 0) {
+                perror("Failed to open audio input");
+                return false;
+            }
+            return true;
+        }
+#ifdef AE5_WITH_ALSA
+        // A short buffer bounds the capture latency; set_params picks periods within it
+        int err = snd_pcm_open(&pcm_, source, SND_PCM_STREAM_CAPTURE, 0);
+        if (err >= 0) {
+            err = snd_pcm_set_params(pcm_, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, AUDIO_CHANNELS,
+                                     AUDIO_RATE, 1, AUDIO_BUFFER_US);
+        }
+        if (err < 0) {
+            fprintf(stderr, "Error: Failed to open capture device %s: %s\n", source, snd_strerror(err));
+            return false;
+        }
+        return true;
+#else
+        fprintf(stderr, "Error: %s is not a file, and ALSA capture was not built in (-DAE5_WITH_ALSA)\n", source);
+        return false;
+#endif
+    }
+
+    // Read exactly frames frames; false at the end of the input, on an error or on a stop signal
+    bool read(int16_t* buffer, size_t frames) {
+#ifdef AE5_WITH_ALSA
+        if (pcm_) {
+            while (frames > 0 && !g_stop_requested) {
+                snd_pcm_sframes_t n = snd_pcm_readi(pcm_, buffer, frames);
+                if (n < 0) {
+                    // An overrun drops the queued audio, which is what we want anyway
+                    if (n == -EPIPE) overruns++;
+                    if (snd_pcm_recover(pcm_, n, 1) < 0) return false;
+                    continue;
+                }
+                buffer += n * AUDIO_CHANNELS;
+                frames -= n;
+            }
+            return frames == 0;
+        }
+#endif
+        uint8_t* p = reinterpret_cast<uint8_t*>(buffer);
+        size_t left = frames * AUDIO_CHANNELS * sizeof(int16_t);
+        while (left > 0) {
+            ssize_t n = ::read(fd_, p, left);
+            if (n < 0 && errno == EINTR && !g_stop_requested) continue;
+            if (n <= 0) return false;
+            p += n;
+            left -= n;
+        }
+        return true;
+    }
+
+    uint64_t overruns = 0;
+
+private:
+    int fd_ = -1;
+#ifdef AE5_WITH_ALSA
+    snd_pcm_t* pcm_ = nullptr;
+#endif
+};
+
+/**
+ * Show audio levels: each period is filtered, mapped onto the LEDs' brightness
+ * fields and written before the next one is read. The write takes well under
+ * a period, so the stages need no queue between them and the latency is the
+ * capture buffer plus one period. LED colors come from the frame given, or
+ * run from red (bass) to violet (treble).
+ */
+int run_audio(CardList& cards, const char* state_path, const char* metrics_path, const char* source,
+              const CardFrames& colors, uint8_t brightness) {
+    install_stop_handlers();
+    AudioInput input;
+    if (!input.open(source)) {
+        return 1;
+    }
+
+    FilterBank bank(AUDIO_RATE);
+    int16_t samples[AUDIO_PERIOD_FRAMES * AUDIO_CHANNELS];
+    const uint64_t period_ns = AUDIO_PERIOD_FRAMES * 1000000000ULL / AUDIO_RATE;
+    const FadeTables& tables = fade_tables();
+
+    CardFrames output(cards.size());
+    CardFrames last(cards.size());
+    output.set_all();
+    for (size_t card = 0; card < cards.size(); card++) {
+        if (colors.has(card)) {
+            output.frames[card] = colors.frames[card];
+        } else {
+            for (int led = 0; led < NUM_LEDS; led++) {
+                output.frames[card].colors[led] = hue_to_rgb(0.8 * led / NUM_LEDS);
+            }
+        }
+    }
+
+    uint64_t periods = 0, written = 0, late = 0, slowest = 0;
+    uint64_t next_metrics = monotonic_ns();
+    while (!g_stop_requested && input.read(samples, AUDIO_PERIOD_FRAMES)) {
+        uint64_t start = monotonic_ns();
+        bank.process(samples, AUDIO_PERIOD_FRAMES, AUDIO_CHANNELS);
+
+        // Levels are perceptual, the brightness field is linear
+        for (int led = 0; led < NUM_LEDS; led++) {
+            uint8_t field = tables.lightness_decode[(int)(bank.level[led] * 255 + 0.5f)] * brightness / MAX_BRIGHTNESS;
+            for (size_t card = 0; card < cards.size(); card++) {
+                output.frames[card].brightness[led] = field;
+            }
+        }
+        if (!frames_unchanged(output, last)) {
+            send_card_frames(cards, output);
+            merge_card_frames(last, output);
+            written++;
+        }
+        periods++;
+
+        uint64_t now = monotonic_ns();
+        slowest = std::max(slowest, now - start);
+        if (now - start > period_ns) {
+            late++;
+            g_metrics.missed_deadlines.add();
+        }
+        if (metrics_path && now >= next_metrics) {
+            write_metrics_file(metrics_path, cards);
+            next_metrics = now + METRICS_INTERVAL_MS * 1000000ULL;
+        }
+    }
+
+    save_frame_state(state_path, last);
+    write_metrics_file(metrics_path, cards);
+    fprintf(stderr, "Audio: %llu periods of %.1f ms (%llu frames written), %llu late, %llu overruns, "
+            "slowest %.2f ms\n", (unsigned long long)periods, period_ns / 1e6, (unsigned long long)written,
+            (unsigned long long)late, (unsigned long long)input.overruns, slowest / 1e6);
+    print_write_stats(cards);
+    return 0;
+}
+
+/**
+ * Write one frame per input line, in the command-line frame syntax. Lines are
+ * written as fast as they arrive, so the producer sets the pace; a bad line
+ * is reported and skipped. Nothing is allocated per line.
+ */
+int run_batch(CardList& cards, const char* state_path, uint8_t brightness, FILE* input) {
+    install_stop_handlers();
+
+    CardFrames last;
+    if (!load_frame_state(state_path, last) || last.size() != cards.size()) {
+        last = CardFrames(cards.size());
+    }
+    CardFrames request(cards.size());
+    FrameRequest frame;
+    char line[DAEMON_MAX_LINE + 2];
+    uint64_t lines = 0, written = 0, errors = 0;
+
+    while (!g_stop_requested && fgets(line, sizeof(line), input)) {
+        lines++;
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] != '\n' && !feof(input)) {
+            // Too long: drop the rest of the line
+            int c;
+            while ((c = fgetc(input)) != EOF && c != '\n') {}
+            fprintf(stderr, "Error: Line %llu is too long\n", (unsigned long long)lines);
+            errors++;
+            continue;
+        }
+
+        const char* p = line;
+        while (is_blank(*p)) p++;
+        if (!*p) continue;
+
+        if (!parse_frame_line(line, frame) || !build_card_frames(frame, cards.size(), brightness, request)) {
+            fprintf(stderr, "Error: Skipping line %llu\n", (unsigned long long)lines);
+            errors++;
+            continue;
+        }
+        if (!frames_unchanged(request, last)) {
+            send_card_frames(cards, request);
+            merge_card_frames(last, request);
+            written++;
+        }
+    }
+
+    save_frame_state(state_path, last);
+    fprintf(stderr, "Batch: %llu lines, %llu frames written, %llu errors\n", (unsigned long long)lines,
+            (unsigned long long)written, (unsigned long long)errors);
+    return errors ? 1 : 0;
+}
+
+enum WatchCompare {
+    WATCH_LESS,
+    WATCH_LESS_EQUAL,
+    WATCH_GREATER,
+    WATCH_GREATER_EQUAL,
+    WATCH_EQUAL,
+    WATCH_NOT_EQUAL
+};
+
+/**
+ * A number the watcher maps to colors: the first field of a file. Files in
+ * sysfs and /proc stay open and are read again on every timer tick, and at
+ * once when sysfs notifies a change (hwmon alarms, for one). Other files are
+ * status files written by other programs and are read again whenever inotify
+ * reports them rewritten, so they cost nothing while they don't change.
+ */
+struct WatchSource {
+    std::string path;
+    bool status_file;
+    int fd = -1;       // sysfs and /proc files
+    int watch = -1;    // inotify watch on the directory of a status file
+    std::string name;  // file name within that directory
+    bool valid = false;
+    double value = 0;
+};
+
+// "<source> <comparison> <threshold> <frame>"; the frame applies while the comparison holds
+struct WatchRule {
+    size_t source;
+    WatchCompare compare;
+    double threshold;
+    FrameRequest request;
+};
+
+bool parse_watch_compare(const char* str, WatchCompare& compare) {
+    static const struct {
+        const char* name;
+        WatchCompare compare;
+    } kCompares[] = {
+        {"<", WATCH_LESS}, {"<=", WATCH_LESS_EQUAL}, {">", WATCH_GREATER},
+        {">=", WATCH_GREATER_EQUAL}, {"==", WATCH_EQUAL}, {"!=", WATCH_NOT_EQUAL},
+    };
+    for (const auto& entry : kCompares) {
+        if (strcmp(str, entry.name) == 0) {
+            compare = entry.compare;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool watch_rule_holds(const WatchRule& rule, double value) {
+    switch (rule.compare) {
+    case WATCH_LESS: return value < rule.threshold;
+    case WATCH_LESS_EQUAL: return value <= rule.threshold;
+    case WATCH_GREATER: return value > rule.threshold;
+    case WATCH_GREATER_EQUAL: return value >= rule.threshold;
+    case WATCH_EQUAL: return value == rule.threshold;
+    default: return value != rule.threshold;
+    }
+}
+
+size_t add_watch_source(std::vector<WatchSource>& sources, const char* path) {
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i].path == path) return i;
+    }
+    sources.emplace_back();
+    WatchSource& source = sources.back();
+    source.path = path;
+    source.status_file = strncmp(path, "/sys/", 5) != 0 && strncmp(path, "/proc/", 6) != 0;
+    return sources.size() - 1;
+}
 
 /**
- * Structure to represent RGB color values
- * Each component ranges from 0-255
+ * Rules files hold "interval <ms>" and rule lines; '#' starts a comment.
+ * A source is an absolute path or "load" (the one-minute load average).
  */
-struct RGB {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-
-    RGB(uint8_t r = 0, uint8_t g = 0, uint8_t b = 0) : red(r), green(g), blue(b) {}
-};
+bool load_watch_rules(const char* path, std::vector<WatchSource>& sources, std::vector<WatchRule>& rules,
+                      uint64_t& interval_ms) {
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open rules file %s\n", path);
+        return false;
+    }
 
-// LED color configuration structure
-struct LEDConfig {
-    int position;
-    RGB color;
-    
-    LEDConfig(int pos, const RGB& c) : position(pos), color(c) {}
-};
+    char line[DAEMON_MAX_LINE + 2];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        size_t length = strcspn(line, "\n");
+        if (line[length] != '\n' && !feof(file)) {
+            fprintf(stderr, "Error: Rule line too long at %s:%d\n", path, line_number);
+            ok = false;
+            break;
+        }
+        line[length] = '\0';
+        strip_comment(line);
 
-// Function declarations
-void print_usage(const char* program_name);
-bool parse_led_configs(int argc, char* argv[], std::vector<LEDConfig>& configs);
-bool parse_color(const char* str, RGB& color);
-bool parse_single_color(int argc, char* argv[], RGB& color);
+        char* args[DAEMON_MAX_ARGS + 1];
+        int count = split_request_args(line, args, DAEMON_MAX_ARGS);
+        if (count == 1) continue;
 
-class ScopedFD {
-public:
-    explicit ScopedFD(int fd) : fd_(fd) {}
-    ~ScopedFD() { if (fd_ >= 0) close(fd_); }
-    int get() const { return fd_; }
-    int release() { int tmp = fd_; fd_ = -1; return tmp; }
-private:
-    int fd_;
-    // Prevent copying
-    ScopedFD(const ScopedFD&) = delete;
-    ScopedFD& operator=(const ScopedFD&) = delete;
-};
+        if (count == 3 && strcmp(args[1], "interval") == 0) {
+            if (!parse_period(args[2], interval_ms)) {
+                fprintf(stderr, "Error: Invalid interval at %s:%d\n", path, line_number);
+                ok = false;
+                break;
+            }
+            continue;
+        }
 
-class ScopedMMIO {
-public:
-    ScopedMMIO(void* base, size_t size) : base_(base), size_(size) {}
-    ~ScopedMMIO() { 
-        if (base_ != MAP_FAILED) {
-            munmap(base_, size_);
+        // The threshold takes the place of the program name for the frame parser
+        WatchRule rule;
+        char* end = nullptr;
+        const char* source = strcmp(args[1], "load") == 0 ? WATCH_LOAD_SOURCE : args[1];
+        if (count < 5 || source[0] != '/' || !parse_watch_compare(args[2], rule.compare) ||
+            (rule.threshold = strtod(args[3], &end), end == args[3] || *end != '\0') ||
+            !parse_led_configs(count - 3, args + 3, rule.request)) {
+            fprintf(stderr, "Error: Invalid rule at %s:%d\n", path, line_number);
+            ok = false;
+            break;
         }
+        rule.source = add_watch_source(sources, source);
+        rules.push_back(rule);
+    }
+    fclose(file);
+    if (!ok) {
+        return false;
     }
-    void* get() const { return base_; }
-private:
-    void* base_;
-    size_t size_;
-    // Prevent copying
-    ScopedMMIO(const ScopedMMIO&) = delete;
-    ScopedMMIO& operator=(const ScopedMMIO&) = delete;
-};
 
-bool check_root_privileges() {
-    return (geteuid() == 0);
+    if (rules.empty()) {
+        fprintf(stderr, "Error: No rules in %s\n", path);
+        return false;
+    }
+    return true;
 }
 
-void write_mmio(void* base, uint32_t offset, uint32_t value) {
-    mmio_reg_t reg = (mmio_reg_t)((uint8_t*)base + offset);
-    *reg = value;
+// Read the source's value; a source that can't be read matches no rule
+void read_watch_source(WatchSource& source) {
+    char buf[64];
+    ssize_t n;
+    if (source.status_file) {
+        ScopedFD fd(open(source.path.c_str(), O_RDONLY | O_CLOEXEC));
+        n = fd.get() >= 0 ? read(fd.get(), buf, sizeof(buf) - 1) : -1;
+    } else {
+        n = source.fd >= 0 ? pread(source.fd, buf, sizeof(buf) - 1, 0) : -1;
+    }
+
+    char* end = buf;
+    if (n > 0) {
+        buf[n] = '\0';
+        source.value = strtod(buf, &end);
+    }
+    source.valid = n > 0 && end != buf;
 }
 
-// Function to find MMIO base address
-uint64_t find_mmio_base_address() {
-    const char* pci_path = "/sys/bus/pci/devices";
-    DIR* dir = opendir(pci_path);
-    if (!dir) {
-        throw std::runtime_error("Failed to open PCI devices directory");
+/**
+ * Stage the LEDs the rules decide. For every LED, the first rule in the file
+ * that holds and sets it gives its color; LEDs that rules set but none holds
+ * for are turned off. LEDs no rule mentions are left alone. Returns whether
+ * anything differs from frames, which is updated.
+ */
+bool apply_watch_rules(const std::vector<WatchSource>& sources, const std::vector<WatchRule>& rules,
+                       uint8_t brightness, CardFrames& frames, AE5Device& device) {
+    bool changed = false;
+    for (size_t card = 0; card < frames.size(); card++) {
+        for (int led = 0; led < NUM_LEDS; led++) {
+            bool mentioned = false;
+            RGB color;
+            int led_brightness = brightness;
+            for (const auto& rule : rules) {
+                int slot = (rule.request.present[card + 1] >> led) & 0x01 ? card + 1
+                         : (rule.request.present[0] >> led) & 0x01 ? 0 : -1;
+                if (slot < 0) continue;
+                mentioned = true;
+                const WatchSource& source = sources[rule.source];
+                if (source.valid && watch_rule_holds(rule, source.value)) {
+                    color = rule.request.colors[slot][led];
+                    if (rule.request.brightness[slot][led] >= 0) led_brightness = rule.request.brightness[slot][led];
+                    break;
+                }
+            }
+            if (!mentioned) continue;
+
+            LEDFrame& frame = frames.frames[card];
+            if (!frames.has(card) || frame.colors[led].red != color.red || frame.colors[led].green != color.green ||
+                frame.colors[led].blue != color.blue || frame.brightness[led] != led_brightness) {
+                changed = true;
+            }
+            frame.colors[led] = color;
+            frame.brightness[led] = led_brightness;
+            device.set_led(card, led, color, led_brightness);
+        }
     }
+    frames.set_all();
+    return changed;
+}
+
+// Tags of the epoll events; sysfs sources use their index
+#define WATCH_TIMER_EVENT UINT64_MAX
+#define WATCH_INOTIFY_EVENT (UINT64_MAX - 1)
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (entry->d_name[0] == '.') continue;
+/**
+ * Map system state to the LEDs with one epoll loop: a timerfd paces the
+ * sysfs and /proc reads, sysfs attributes that notify wake it early, and
+ * inotify reports rewritten status files. The LEDs are only written when a
+ * color the rules decide changes. Frames go to the daemon if one is running.
+ */
+int run_watch(const char* rules_path, const AE5DeviceOptions& options, uint8_t brightness) {
+    std::vector<WatchSource> sources;
+    std::vector<WatchRule> rules;
+    uint64_t interval_ms = WATCH_DEFAULT_INTERVAL_MS;
+    if (!load_watch_rules(rules_path, sources, rules, interval_ms)) {
+        return 1;
+    }
+    std::unique_ptr<AE5Device> device = AE5Device::open(options);
+    if (!device) {
+        return 1;
+    }
+    for (const auto& rule : rules) {
+        if (highest_card(rule.request) >= (int)device->num_cards()) {
+            fprintf(stderr, "Error: Card %d not found (%zu card(s) present)\n", highest_card(rule.request),
+                    device->num_cards());
+            return 1;
+        }
+    }
 
-        std::string device_path = std::string(pci_path) + "/" + entry->d_name;
+    ScopedFD epoll_fd(epoll_create1(EPOLL_CLOEXEC));
+    ScopedFD timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+    ScopedFD inotify_fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+    if (epoll_fd.get() < 0 || timer_fd.get() < 0 || inotify_fd.get() < 0) {
+        perror("Failed to set up the watch loop");
+        return 1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = WATCH_TIMER_EVENT;
+    epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, timer_fd.get(), &event);
+    event.data.u64 = WATCH_INOTIFY_EVENT;
+    epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, inotify_fd.get(), &event);
 
-        // Read vendor ID
-        std::ifstream vendor_file(device_path + "/vendor");
-        std::string vendor_id;
-        if (!vendor_file || !(vendor_file >> vendor_id)) continue;
-        vendor_id = vendor_id.substr(2); // Remove "0x" prefix
+    bool timed = false;
+    for (size_t i = 0; i < sources.size(); i++) {
+        WatchSource& source = sources[i];
+        if (source.status_file) {
+            // Watch the directory, so files replaced by a rename are seen too
+            size_t slash = source.path.rfind('/');
+            std::string dir = slash == 0 ? "/" : source.path.substr(0, slash);
+            source.name = source.path.substr(slash + 1);
+            source.watch = inotify_add_watch(inotify_fd.get(), dir.c_str(),
+                                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+            if (source.watch < 0) {
+                fprintf(stderr, "Error: Failed to watch %s: %s\n", dir.c_str(), strerror(errno));
+                return 1;
+            }
+        } else {
+            source.fd = open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (source.fd < 0) {
+                fprintf(stderr, "Error: Failed to open %s: %s\n", source.path.c_str(), strerror(errno));
+                return 1;
+            }
+            // Only sysfs attributes can be polled; /proc files just fail here
+            event.events = EPOLLPRI | EPOLLERR;
+            event.data.u64 = i;
+            epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, source.fd, &event);
+            timed = true;
+        }
+        read_watch_source(source);
+    }
+    if (timed) {
+        struct itimerspec timer;
+        timer.it_interval.tv_sec = interval_ms / 1000;
+        timer.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+        timer.it_value = timer.it_interval;
+        timerfd_settime(timer_fd.get(), 0, &timer, nullptr);
+    }
 
-        // Read device ID
-        std::ifstream device_file(device_path + "/device");
-        std::string device_id;
-        if (!device_file || !(device_file >> device_id)) continue;
-        device_id = device_id.substr(2); // Remove "0x" prefix
+    install_stop_handlers();
+    CardFrames frames(device->num_cards());
+    uint64_t wakeups = 0, written = 0;
+    bool ok = true;
+    apply_watch_rules(sources, rules, brightness, frames, *device);
+    if (device->commit()) {
+        written++;
+    } else {
+        ok = false;
+    }
 
-        // Check if this is our target device
-        if (vendor_id == TARGET_VENDOR && device_id == TARGET_DEVICE) {
-            // Read resource file to get memory regions
-            std::ifstream resource_file(device_path + "/resource");
-            std::string line;
-            int region = 0;
+    struct epoll_event events[16];
+    while (!g_stop_requested && ok) {
+        int ready = epoll_wait(epoll_fd.get(), events, 16, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        wakeups++;
 
-            while (std::getline(resource_file, line) && region <= TARGET_REGION) {
-                if (region == TARGET_REGION) {
-                    uint64_t start, end;
-                    if (sscanf(line.c_str(), "0x%lx 0x%lx", &start, &end) == 2) {
-                        closedir(dir);
-                        return start;
+        for (int e = 0; e < ready; e++) {
+            uint64_t tag = events[e].data.u64;
+            if (tag == WATCH_TIMER_EVENT) {
+                uint64_t expirations;
+                ssize_t ignored = read(timer_fd.get(), &expirations, sizeof(expirations));
+                (void)ignored;
+                for (auto& source : sources) {
+                    if (!source.status_file) read_watch_source(source);
+                }
+            } else if (tag == WATCH_INOTIFY_EVENT) {
+                alignas(struct inotify_event) char buf[4096];
+                ssize_t n;
+                while ((n = read(inotify_fd.get(), buf, sizeof(buf))) > 0) {
+                    for (char* p = buf; p < buf + n;) {
+                        const struct inotify_event* change = reinterpret_cast<const struct inotify_event*>(p);
+                        for (auto& source : sources) {
+                            if (source.watch == change->wd && change->len && source.name == change->name) {
+                                read_watch_source(source);
+                            }
+                        }
+                        p += sizeof(struct inotify_event) + change->len;
                     }
                 }
-                region++;
+            } else {
+                read_watch_source(sources[tag]);
             }
         }
+
+        if (apply_watch_rules(sources, rules, brightness, frames, *device)) {
+            written++;
+            ok = device->commit();
+        }
     }
 
-    closedir(dir);
-    throw std::runtime_error("Failed to find target device or memory region");
+    for (const auto& source : sources) {
+        if (source.fd >= 0) close(source.fd);
+    }
+    fprintf(stderr, "Watch: %llu wakeups, %llu frames written\n", (unsigned long long)wakeups,
+            (unsigned long long)written);
+    return ok ? 0 : 1;
 }
 
-void write_led_bit(void* base, bool is_high) {
-    write_mmio(base, LED_CONTROL_OFFSET, is_high ? LED_BIT_HIGH : LED_BIT_LOW);
-    write_mmio(base, LED_CONTROL_OFFSET, LED_CLOCK_HIGH);
-    write_mmio(base, LED_CONTROL_OFFSET, LED_CLOCK_LOW);
+// Print p50/p99/max of samples (in ns) for an operation covering bits bits and stores MMIO stores
+void print_bench_row(const char* name, std::vector<uint64_t>& samples, int bits, int stores) {
+    std::sort(samples.begin(), samples.end());
+    uint64_t p50 = samples[samples.size() / 2];
+    uint64_t p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+    uint64_t max = samples.back();
+
+    printf("%-20s %10.2f %10.2f %10.2f %12.1f", name, p50 / 1e3, p99 / 1e3, max / 1e3, (double)p50 / bits);
+    if (stores > 0 && p50 > 0) {
+        printf(" %14.0f\n", stores * 1e9 / p50);
+    } else {
+        printf(" %14s\n", "-");
+    }
 }
 
-uint32_t rgb_to_hex(const RGB& color) {
-    return (color.blue << 16) | (color.green << 8) | color.red;
+/**
+ * Time the reference bit-bang phases and the compiled frame path. With a dry
+ * run the card is a plain memory buffer, so the numbers show software overhead
+ * only; on hardware the difference is MMIO store latency.
+ */
+int run_bench(Card& card, const LEDFrame& frame, int iterations) {
+    std::vector<uint64_t> start_samples, led_samples, end_samples, frame_samples;
+    std::vector<uint64_t> compile_samples, stream_samples, encode_samples, timed_samples, merged_samples;
+    MMIOBackend& io = card.io;
+    NullBackend null_sink;
+    CompiledFrame compiled;
+
+    for (int iter = 0; iter < iterations; iter++) {
+        uint64_t frame_start = raw_ns();
+        send_start_frame(io);
+        uint64_t t = raw_ns();
+        start_samples.push_back(t - frame_start);
+
+        for (int led = 0; led < NUM_LEDS; led++) {
+            uint64_t led_start = raw_ns();
+            send_led_color(io, rgb_to_hex(frame.colors[led]), frame.brightness[led]);
+            led_samples.push_back(raw_ns() - led_start);
+        }
+
+        t = raw_ns();
+        send_end_frame(io);
+        uint64_t frame_end = raw_ns();
+        end_samples.push_back(frame_end - t);
+        frame_samples.push_back(frame_end - frame_start);
+
+        t = raw_ns();
+        compile_frame(frame, compiled);
+        compile_samples.push_back(raw_ns() - t);
+
+        t = raw_ns();
+        stream_frame(io, compiled);
+        stream_samples.push_back(raw_ns() - t);
+
+        t = raw_ns();
+        stream_frame(io, compiled, card.timing);
+        timed_samples.push_back(raw_ns() - t);
+
+        t = raw_ns();
+        stream_frame(io, compiled, FrameTiming(0, ENCODING_MERGED));
+        merged_samples.push_back(raw_ns() - t);
+
+        t = raw_ns();
+        send_reference_frame(null_sink, frame);
+        encode_samples.push_back(raw_ns() - t);
+    }
+    // Don't leave the LEDs on one of the faster, less tolerant encodings
+    stream_frame(io, compiled);
+
+    printf("Benchmark: %d iterations on %s\n", iterations, card.device.bdf.c_str());
+    printf("%-20s %10s %10s %10s %12s %14s\n", "phase", "p50 (us)", "p99 (us)", "max (us)", "ns/bit", "stores/s");
+    print_bench_row("send_start_frame", start_samples, START_FRAME_BITS, START_FRAME_BITS * WRITES_PER_BIT);
+    print_bench_row("send_led_color", led_samples, LED_FRAME_BITS, LED_FRAME_BITS * WRITES_PER_BIT);
+    print_bench_row("send_end_frame", end_samples, END_FRAME_BITS, END_FRAME_BITS * WRITES_PER_BIT);
+    print_bench_row("reference frame", frame_samples, FRAME_BITS, FRAME_WRITES);
+    print_bench_row("reference encode", encode_samples, FRAME_BITS, 0);
+    print_bench_row("compile_frame", compile_samples, FRAME_BITS, 0);
+    print_bench_row("stream_frame", stream_samples, FRAME_BITS, FRAME_WRITES);
+    print_bench_row("stream (merged)", merged_samples, FRAME_BITS, FRAME_BITS * 2);
+    print_bench_row("stream (calibrated)", timed_samples, FRAME_BITS, card.timing.stores());
+    return 0;
 }
 
+// Candidate timings from the shortest frame to the slowest clock
+static const FrameTiming kTimingCandidates[] = {
+    FrameTiming(0, ENCODING_MERGED),
+    FrameTiming(0, ENCODING_FULL),
+    FrameTiming(1, ENCODING_FULL),
+    FrameTiming(4, ENCODING_FULL),
+    FrameTiming(CALIBRATION_MAX_SPACING, ENCODING_FULL),
+};
 
-void print_usage(const char* program_name) {
-    fprintf(stderr, "AE-5 RGB Controller\n");
-    fprintf(stderr, "===================================\n");
-    fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  Single color for all LEDs:\n");
-    fprintf(stderr, "    %s <r> <g> <b>\n\n", program_name);
-    fprintf(stderr, "  Different colors per LED:\n");
-    fprintf(stderr, "    %s <led_position>:<r,g,b> [<led_position>:<r,g,b> ...]\n\n", program_name);
-    fprintf(stderr, "Arguments:\n");
-    fprintf(stderr, "  led_position : LED number (0-%d)\n", NUM_LEDS-1);
-    fprintf(stderr, "  r,g,b       : RGB values (0-255)\n");
-    fprintf(stderr, "\nExamples:\n");
-    fprintf(stderr, "  %s 255 0 0               # Set all LEDs to red\n", program_name);
-    fprintf(stderr, "  %s 0:255,0,0             # Set LED 0 to red\n", program_name);
-    fprintf(stderr, "  %s 0:255,0,0 1:0,255,0   # Set LED 0 to red, LED 1 to green\n", program_name);
-    fprintf(stderr, "\nNote: This program requires root privileges to access hardware.\n");
-    fprintf(stderr, "Run with sudo or as root user.\n");
+static const struct {
+    const char* name;
+    RGB color;
+} kCalibrationPalette[] = {
+    {"red", RGB(255, 0, 0)},
+    {"green", RGB(0, 255, 0)},
+    {"blue", RGB(0, 0, 255)},
+    {"white", RGB(255, 255, 255)},
+    {"off", RGB(0, 0, 0)},
+};
+
+bool ask_yes_no(const char* question) {
+    printf("%s [y/N] ", question);
+    fflush(stdout);
+    char answer[16];
+    return fgets(answer, sizeof(answer), stdin) && (answer[0] == 'y' || answer[0] == 'Y');
 }
 
-bool parse_color(const char* str, RGB& color) {
-    int r, g, b;
-    if (sscanf(str, "%d,%d,%d", &r, &g, &b) != 3) {
-        return false;
+/**
+ * Find the fastest timing each card shows correctly. The register is read
+ * back first to make sure the card responds at all; whether the LEDs latched
+ * the right colors can only be seen, so every candidate shows a test pattern
+ * (rotated between candidates, so a stale frame never passes) and the user
+ * confirms it. Write-combining lets posted stores stream at bus speed, so
+ * it is tried before the uncached mapping. Results are stored per card in
+ * CALIBRATION_FILE_PATH.
+ */
+int run_calibration(CardList& cards) {
+    std::map<std::string, FrameTiming> timings = load_calibration(CALIBRATION_FILE_PATH);
+
+    for (size_t c = 0; c < cards.size(); c++) {
+        Card& card = *cards[c];
+        printf("Calibrating card %zu (%s)\n", c, card.device.bdf.c_str());
+
+        // A card that dropped off the bus reads back all ones
+        send_frame(card.io, LEDFrame(), nullptr);
+        uint32_t readback = card.io.read(LED_CONTROL_OFFSET);
+        if (readback == 0xFFFFFFFF) {
+            fprintf(stderr, "Error: Card %zu does not respond (register reads 0x%08x)\n", c, readback);
+            return 1;
+        }
+
+        // The write-combining mapping, where the BAR has one, is tried first.
+        // If no timing works through it, the candidates are tried again uncached.
+        remap_card(card, true);
+        bool found = false;
+        size_t shown = 0;
+        const size_t palette_size = sizeof(kCalibrationPalette) / sizeof(kCalibrationPalette[0]);
+        for (int pass = card.io.write_combining() ? 0 : 1; pass < 2 && !found; pass++) {
+            if (pass == 1 && card.io.write_combining() && !remap_card(card, false)) {
+                fprintf(stderr, "Error: Failed to map card %zu uncached\n", c);
+                return 1;
+            }
+            for (size_t t = 0; t < sizeof(kTimingCandidates) / sizeof(kTimingCandidates[0]) && !found; t++) {
+                const FrameTiming timing(kTimingCandidates[t].spacing, kTimingCandidates[t].encoding,
+                                         card.io.write_combining());
+
+                LEDFrame frame;
+                std::string expected;
+                for (int led = 0; led < NUM_LEDS; led++) {
+                    size_t entry = (led + shown) % palette_size;
+                    frame.colors[led] = kCalibrationPalette[entry].color;
+                    expected += std::string(led ? ", " : "") + kCalibrationPalette[entry].name;
+                }
+                shown++;
+                send_frame(card.io, frame, nullptr, timing);
+
+                printf("  %d stores/frame, spacing %d%s: LEDs 0-%d should be %s\n", timing.stores(),
+                       timing.spacing, timing.write_combining ? ", write-combining" : "", NUM_LEDS - 1,
+                       expected.c_str());
+                if (ask_yes_no("  Is that what the LEDs show?")) {
+                    timings[card.device.bdf] = timing;
+                    card.timing = timing;
+                    found = true;
+                }
+            }
+        }
+
+        if (!found) {
+            fprintf(stderr, "Warning: No timing confirmed for card %zu, keeping the default\n", c);
+            timings.erase(card.device.bdf);
+            card.timing = FrameTiming();
+        }
     }
-    
-    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
-        return false;
+
+    save_calibration(CALIBRATION_FILE_PATH, timings);
+    return 0;
+}
+
+// Whether value lies between a and b, give or take the rounding of the fade tables
+bool within_fade(uint8_t a, uint8_t b, uint8_t value) {
+    return value + 1 >= std::min(a, b) && value <= std::max(a, b) + 1;
+}
+
+bool frame_within_fade(const LEDFrame& a, const LEDFrame& b, const LEDFrame& frame) {
+    for (int led = 0; led < NUM_LEDS; led++) {
+        if (!within_fade(a.colors[led].red, b.colors[led].red, frame.colors[led].red) ||
+            !within_fade(a.colors[led].green, b.colors[led].green, frame.colors[led].green) ||
+            !within_fade(a.colors[led].blue, b.colors[led].blue, frame.colors[led].blue) ||
+            !within_fade(a.brightness[led], b.brightness[led], frame.brightness[led])) {
+            return false;
+        }
     }
-    
-    color = RGB(r, g, b);
     return true;
 }
 
-bool parse_single_color(int argc, char* argv[], RGB& color) {
-    if (argc != 4) return false;
-    
-    char* endptr;
-    errno = 0;
-    
-    // Parse R, G, B values
-    long r = strtol(argv[1], &endptr, 10);
-    if (errno != 0 || *endptr != '\0' || r < 0 || r > 255) return false;
-    
-    long g = strtol(argv[2], &endptr, 10);
-    if (errno != 0 || *endptr != '\0' || g < 0 || g > 255) return false;
-    
-    long b = strtol(argv[3], &endptr, 10);
-    if (errno != 0 || *endptr != '\0' || b < 0 || b > 255) return false;
-    
-    color = RGB(r, g, b);
+/**
+ * Check the compiled frame path against the reference encoder. Both are run
+ * into a recording backend for random frames and must produce the same
+ * register-write sequence. Needs neither root nor the card.
+ */
+int run_self_test(int iterations) {
+    unsigned int seed = 1;
+    RecordingBackend reference, compiled;
+    FrameCache cache;
+    LEDFrame previous;
+
+    for (int iter = 0; iter < iterations; iter++) {
+        LEDFrame frame;
+        for (int led = 0; led < NUM_LEDS; led++) {
+            frame.colors[led] = RGB(rand_r(&seed), rand_r(&seed), rand_r(&seed));
+            frame.brightness[led] = rand_r(&seed);
+        }
+
+        reference.writes.clear();
+        compiled.writes.clear();
+        send_reference_frame(reference, frame);
+        send_frame(compiled, frame, iter % 2 ? &cache : nullptr);
+
+        bool offsets_ok = true;
+        for (const auto& w : reference.writes) {
+            offsets_ok = offsets_ok && w.offset == LED_CONTROL_OFFSET;
+        }
+        if (reference.writes.size() != FRAME_WRITES || !offsets_ok) {
+            fprintf(stderr, "Self-test failed: reference encoder wrote %zu values, expected %d\n",
+                    reference.writes.size(), FRAME_WRITES);
+            return 1;
+        }
+        if (compiled.writes != reference.writes) {
+            fprintf(stderr, "Self-test failed: compiled frame %d differs from the reference encoder\n", iter);
+            return 1;
+        }
+        // Every LED field starts with the marker bits and the 5-bit global brightness
+        for (int led = 0; led < NUM_LEDS; led++) {
+            uint32_t header = 0;
+            for (int bit = 0; bit < BRIGHTNESS_BITS; bit++) {
+                size_t w = (START_FRAME_BITS + led * LED_FRAME_BITS + bit) * WRITES_PER_BIT;
+                header = header << 1 | (reference.writes[w].value == LED_BIT_HIGH);
+            }
+            if (header != (LED_HEADER_MARKER | frame.brightness[led] >> (8 - GLOBAL_BRIGHTNESS_BITS))) {
+                fprintf(stderr, "Self-test failed: LED %d of frame %d has header 0x%02x for brightness %u\n",
+                        led, iter, header, frame.brightness[led]);
+                return 1;
+            }
+        }
+
+        // Without the clock-low writes the sequence is the reference minus those,
+        // plus one at the end; pacing adds only reads
+        RecordingBackend skipped;
+        send_frame(skipped, frame, nullptr, FrameTiming(1, ENCODING_SKIP_CLOCK_LOW));
+        std::vector<RecordingBackend::Write> expected_skipped;
+        for (size_t w = 0; w < reference.writes.size(); w++) {
+            if (w % WRITES_PER_BIT != 2) expected_skipped.push_back(reference.writes[w]);
+        }
+        expected_skipped.push_back({LED_CONTROL_OFFSET, LED_CLOCK_LOW});
+        if (skipped.writes != expected_skipped || skipped.reads != skipped.writes.size() - 1) {
+            fprintf(stderr, "Self-test failed: timed stream of frame %d differs from the reference encoder\n", iter);
+            return 1;
+        }
+
+        // The merged encoding must clock in the same bits as the reference
+        LatchModelBackend reference_bits, merged_bits;
+        send_reference_frame(reference_bits, frame);
+        send_frame(merged_bits, frame, nullptr, FrameTiming(0, ENCODING_MERGED));
+        if (reference_bits.bits.size() != FRAME_BITS || merged_bits.bits != reference_bits.bits) {
+            fprintf(stderr, "Self-test failed: merged encoding of frame %d latches different bits\n", iter);
+            return 1;
+        }
+        // Skipping the clock-low writes loses the edge of every repeated one, and
+        // each LED header starts with three
+        LatchModelBackend skipped_bits;
+        send_frame(skipped_bits, frame, nullptr, FrameTiming(0, ENCODING_SKIP_CLOCK_LOW));
+        if (skipped_bits.bits.size() >= reference_bits.bits.size()) {
+            fprintf(stderr, "Self-test failed: skipped clock-low encoding of frame %d latches every bit\n", iter);
+            return 1;
+        }
+
+        // Patching the brightness field must match compiling the dimmed frame
+        CompiledFrame patched, expected;
+        compile_frame(frame, patched);
+        int led = iter % NUM_LEDS;
+        frame.brightness[led] = rand_r(&seed);
+        set_compiled_brightness(patched, led, frame.brightness[led]);
+        compile_frame(frame, expected);
+        if (memcmp(&patched, &expected, sizeof(patched)) != 0) {
+            fprintf(stderr, "Self-test failed: brightness patch of frame %d differs from a full compile\n", iter);
+            return 1;
+        }
+
+        // A fade from the previous frame stays between the two and ends exactly on this one
+        Transition fade;
+        LEDFrame middle, end;
+        fade.begin(previous, frame, 0, 1000);
+        fade.render(1 + iter % 999, middle);
+        fade.render(1000, end);
+        if (!frame_within_fade(previous, frame, middle) || !same_frame(end, frame) || fade.active) {
+            fprintf(stderr, "Self-test failed: fade into frame %d leaves the path between its ends\n", iter);
+            return 1;
+        }
+        previous = frame;
+    }
+
+    printf("Self-test passed: %d frames, compiled output matches the reference encoder\n", iterations);
+    return 0;
+}
+
+// Next line of a daemon reply, without the newline
+bool read_daemon_line(int fd, std::string& buffer, std::string& line) {
+    size_t pos;
+    while ((pos = buffer.find('\n')) == std::string::npos) {
+        char buf[256];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(buf, n);
+    }
+    line = buffer.substr(0, pos);
+    buffer.erase(0, pos + 1);
     return true;
 }
 
-bool parse_led_configs(int argc, char* argv[], std::vector<LEDConfig>& configs) {
-    // First try to parse as a single color for all LEDs
-    RGB single_color;
-    if (parse_single_color(argc, argv, single_color)) {
-        // Add the same color for all LEDs
-        for (int i = 0; i < NUM_LEDS; i++) {
-            configs.emplace_back(i, single_color);
-        }
-        return true;
+/**
+ * Record what the daemon shows on one card into a show file, sampling its
+ * composited frame at a fixed rate. Frames go straight to the file, so a
+ * recording of any length runs in constant memory, and one stopped at any
+ * point is a complete show. Brightness is not recorded; playback applies
+ * --brightness like the other effects.
+ */
+int run_record(const char* show_path, const char* socket_path, unsigned card, int fps, double duration_s) {
+    ScopedFD daemon(connect_daemon_socket(socket_path));
+    if (daemon.get() < 0) {
+        fprintf(stderr, "Error: No daemon is listening on %s\n", socket_path);
+        return 1;
+    }
+    FILE* file = fopen(show_path, "we");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", show_path, strerror(errno));
+        return 1;
     }
+    ShowHeader header;
+    memcpy(header.magic, SHOW_MAGIC, sizeof(header.magic));
+    header.version = SHOW_VERSION;
+    header.leds = NUM_LEDS;
+    header.fps[0] = fps & 0xFF;
+    header.fps[1] = fps >> 8;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
 
-    // If not a single color, parse as individual LED configurations
-    for (int i = 1; i < argc; i++) {
-        char* pos_str = strtok(argv[i], ":");
-        char* color_str = strtok(nullptr, ":");
-        
-        if (!pos_str || !color_str) {
-            fprintf(stderr, "Error: Invalid format for LED configuration: %s\n", argv[i]);
-            fprintf(stderr, "Expected format: <position>:<r,g,b> or <r> <g> <b>\n");
-            return false;
+    install_stop_handlers();
+    char request[32];
+    snprintf(request, sizeof(request), "frame %u\n", card);
+    const uint64_t period_ns = 1000000000ULL / fps;
+    const uint64_t duration_ns = duration_s * 1e9;
+    const uint64_t start = monotonic_ns();
+    uint64_t deadline = start;
+    uint64_t frames = 0;
+    std::string replies, line;
+
+    while (ok && !g_stop_requested && (duration_ns == 0 || deadline - start < duration_ns)) {
+        if (send(daemon.get(), request, strlen(request), MSG_NOSIGNAL) < 0 ||
+            !read_daemon_line(daemon.get(), replies, line) || line == "ERR") {
+            fprintf(stderr, "Error: The daemon did not send frame %llu of card %u\n", (unsigned long long)frames,
+                    card);
+            ok = false;
+            break;
         }
-        
-        // Parse LED position
-        char* endptr;
-        errno = 0;
-        long pos = strtol(pos_str, &endptr, 10);
-        if (errno != 0 || *endptr != '\0' || pos < 0 || pos >= NUM_LEDS) {
-            fprintf(stderr, "Error: Invalid LED position: %s\n", pos_str);
-            return false;
+        uint8_t colors[SHOW_FRAME_SIZE];
+        LEDFrame frame;
+        ok = parse_frame_reply(line.c_str(), card, frame);
+        for (int led = 0; led < NUM_LEDS; led++) {
+            colors[led * 3] = frame.colors[led].red;
+            colors[led * 3 + 1] = frame.colors[led].green;
+            colors[led * 3 + 2] = frame.colors[led].blue;
         }
-        
-        // Parse color
-        RGB color;
-        if (!parse_color(color_str, color)) {
-            fprintf(stderr, "Error: Invalid color format: %s\n", color_str);
-            fprintf(stderr, "Expected format: r,g,b (0-255)\n");
-            return false;
+        ok = ok && read_daemon_line(daemon.get(), replies, line) && line == "OK";
+        if (!ok) {
+            fprintf(stderr, "Error: Invalid frame reply from the daemon\n");
+            break;
         }
-        
-        configs.emplace_back(pos, color);
+        ok = fwrite(colors, sizeof(colors), 1, file) == 1;
+        frames++;
+
+        // Frames missed while behind hold the last one, so the show keeps the daemon's timing
+        deadline += period_ns;
+        uint64_t now = monotonic_ns();
+        if (now > deadline) {
+            uint64_t behind = (now - deadline) / period_ns + 1;
+            for (uint64_t i = 0; i < behind && ok; i++) {
+                ok = fwrite(colors, sizeof(colors), 1, file) == 1;
+            }
+            frames += behind;
+            deadline += behind * period_ns;
+        }
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR && !g_stop_requested) {}
     }
-    
-    return true;
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok && !frames) {
+        unlink(show_path);
+    }
+    fprintf(stderr, "Record: %llu frames at %d fps\n", (unsigned long long)frames, fps);
+    return ok ? 0 : 1;
 }
 
-void send_start_frame(void* mmio_base) {
-    for (int i = 0; i < START_FRAME_BITS; i++) {
-        write_led_bit(mmio_base, false);
+// 1 if a card never confirmed its frame; retries only warn
+int report_write_failures(const CardList& cards) {
+    int result = 0;
+    for (size_t i = 0; i < cards.size(); i++) {
+        if (cards[i]->stats.failures.value() > 0) {
+            fprintf(stderr, "Error: Card %zu did not confirm the frame after %d attempts\n", i, WRITE_ITERATIONS);
+            result = 1;
+        } else if (cards[i]->stats.retries.value() > 0) {
+            fprintf(stderr, "Warning: Card %zu needed %llu retries\n", i,
+                    (unsigned long long)cards[i]->stats.retries.value());
+        }
     }
+    return result;
 }
 
-void send_led_color(void* mmio_base, uint32_t color_value) {
-    // Send brightness bits (all 1's for maximum brightness)
-    for (int i = 0; i < BRIGHTNESS_BITS; i++) {
-        write_led_bit(mmio_base, true);
+/**
+ * A single frame sent through AE5Device, in the daemon's own syntax: to the
+ * daemon when one runs (always for a user without root access), otherwise
+ * straight to the cards. argv[0] is a placeholder for the program name.
+ */
+int run_client(int argc, char* argv[], const AE5DeviceOptions& options, uint8_t brightness, bool force,
+               uint32_t fade_ms) {
+    FrameRequest parsed;
+    if (argc < 2 || !parse_led_configs(argc, argv, parsed)) {
+        return 1;
+    }
+
+    std::unique_ptr<AE5Device> device = AE5Device::open(options);
+    if (!device) {
+        if (!check_root_privileges()) {
+            fprintf(stderr, "Error: This program requires root privileges to access hardware.\n");
+            fprintf(stderr, "Please run with sudo or as root user, or start the daemon.\n");
+        }
+        return 1;
     }
 
-    // Send color bits
-    for (int i = 0; i < COLOR_BITS; i++) {
-        uint32_t bit = (color_value >> (23 - i)) & 0x01;
-        write_led_bit(mmio_base, bit == 1);
+    CardFrames request;
+    if (!build_card_frames(parsed, device->num_cards(), brightness, request)) {
+        return 1;
+    }
+    for (size_t card = 0; card < request.size(); card++) {
+        if (!request.has(card)) continue;
+        if (!options.layer) {
+            device->set_frame(card, request.frames[card]);
+            continue;
+        }
+        // A layer only covers the LEDs given
+        const LEDFrame& frame = request.frames[card];
+        for (int led = 0; led < NUM_LEDS; led++) {
+            if (((parsed.present[0] | parsed.present[card + 1]) >> led) & 0x01) {
+                device->set_led(card, led, frame.colors[led], frame.brightness[led]);
+            }
+        }
+    }
+    // The daemon skips frames it already shows unless forced
+    bool ok = device->commit(force, fade_ms);
+    if (device->is_direct()) {
+        return report_write_failures(device->cards());
     }
+    return ok ? 0 : 1;
 }
 
-void send_end_frame(void* mmio_base) {
-    for (int i = 0; i < 32; i++) {
-        write_led_bit(mmio_base, true);
+// Stand-in for a card that writes to anonymous memory instead of the BAR
+bool open_dry_run_card(CardList& cards) {
+    void* base = mmap(NULL, MMIO_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to allocate dry-run buffer");
+        return false;
     }
+    PCIDevice device;
+    device.bdf = "dry-run memory buffer";
+    cards.emplace_back(new Card(device, base, MMIO_REGION_SIZE));
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    if (!check_root_privileges()) {
+    // Parse options; everything after them is the LED configuration
+    bool daemon_mode = false;
+    bool fifo_queue = false;
+    bool batch_mode = false;
+    const char* shm_name = nullptr;
+    gid_t shm_group = -1;
+    const char* metrics_path = nullptr;
+    bool bench_mode = false;
+    bool self_test = false;
+    bool calibrate = false;
+    bool dry_run = false;
+    bool verify = false;
+    RealtimeOptions realtime;
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    bool force = false;
+    bool effect_mode = false;
+    Effect effect;
+    const char* audio_source = nullptr;
+    const char* keyframe_path = nullptr;
+    const char* watch_path = nullptr;
+    const char* show_path = nullptr;
+    const char* record_path = nullptr;
+    unsigned record_card = 0;
+    uint8_t brightness = MAX_BRIGHTNESS;
+    uint32_t fade_ms = 0;
+    std::vector<std::string> device_bdfs;
+    int fps = EFFECT_DEFAULT_FPS;
+    double duration_s = 0;
+    const char* socket_path = DAEMON_SOCKET_PATH;
+    AE5DeviceOptions client; // layer settings of a frame sent to the daemon
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--daemon") == 0) {
+            daemon_mode = true;
+        } else if (strcmp(argv[arg], "--shm") == 0 && arg + 1 < argc) {
+            shm_name = argv[++arg];
+            if (shm_name[0] != '/' || strchr(shm_name + 1, '/') || strlen(shm_name) > NAME_MAX) {
+                fprintf(stderr, "Error: Shared memory name must look like /name\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--shm-group") == 0 && arg + 1 < argc) {
+            const struct group* group = getgrnam(argv[++arg]);
+            if (!group) {
+                fprintf(stderr, "Error: Unknown group: %s\n", argv[arg]);
+                return 1;
+            }
+            shm_group = group->gr_gid;
+        } else if (strcmp(argv[arg], "--stdin") == 0) {
+            batch_mode = true;
+        } else if (strcmp(argv[arg], "--watch") == 0 && arg + 1 < argc) {
+            watch_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--metrics-file") == 0 && arg + 1 < argc) {
+            metrics_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+#ifdef AE5_WITH_TRACE
+            trace_start(argv[++arg]);
+#else
+            fprintf(stderr, "Error: --trace needs a build with -DAE5_WITH_TRACE\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[arg], "--queue") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp(argv[arg], "fifo") == 0) {
+                fifo_queue = true;
+            } else if (strcmp(argv[arg], "latest") == 0) {
+                fifo_queue = false;
+            } else {
+                fprintf(stderr, "Error: Queue mode must be latest or fifo\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--force") == 0) {
+            force = true;
+        } else if (strcmp(argv[arg], "--socket") == 0 && arg + 1 < argc) {
+            socket_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--effect") == 0 && arg + 1 < argc) {
+            if (!parse_effect(argv[++arg], effect)) {
+                fprintf(stderr, "Error: Invalid effect: %s\n", argv[arg]);
+                return 1;
+            }
+            effect_mode = true;
+        } else if (strcmp(argv[arg], "--audio") == 0 && arg + 1 < argc) {
+            audio_source = argv[++arg];
+        } else if (strcmp(argv[arg], "--keyframes") == 0 && arg + 1 < argc) {
+            keyframe_path = argv[++arg];
+            effect_mode = true;
+        } else if (strcmp(argv[arg], "--play") == 0 && arg + 1 < argc) {
+            show_path = argv[++arg];
+            effect_mode = true;
+        } else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc) {
+            record_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--card") == 0 && arg + 1 < argc) {
+            char* endptr;
+            record_card = strtoul(argv[++arg], &endptr, 10);
+            if (*endptr != '\0' || record_card >= MAX_CARDS) {
+                fprintf(stderr, "Error: Card must be between 0 and %d\n", MAX_CARDS - 1);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--device") == 0 && arg + 1 < argc) {
+            std::string bdf;
+            if (!normalize_bdf(argv[++arg], bdf) || device_bdfs.size() >= MAX_CARDS) {
+                fprintf(stderr, "Error: Invalid PCI address: %s\n", argv[arg]);
+                return 1;
+            }
+            device_bdfs.push_back(bdf);
+        } else if (strcmp(argv[arg], "--brightness") == 0 && arg + 1 < argc) {
+            if (!parse_brightness(argv[++arg], brightness)) {
+                fprintf(stderr, "Error: Brightness must be between 0 and %d\n", MAX_BRIGHTNESS);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--fade") == 0 && arg + 1 < argc) {
+            if (!parse_fade(argv[++arg], fade_ms)) {
+                fprintf(stderr, "Error: Fade must be between 0 and %d ms\n", FADE_MAX_MS);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--layer") == 0 && arg + 1 < argc) {
+            client.layer = argv[++arg];
+            if (!parse_layer_name(client.layer)) {
+                fprintf(stderr, "Error: Layer names are 1-%d letters, digits, '-', '_' or '.'\n",
+                        DAEMON_LAYER_NAME_MAX);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--priority") == 0 && arg + 1 < argc) {
+            unsigned value;
+            if (!parse_layer_value(argv[++arg], 255, value)) {
+                fprintf(stderr, "Error: Priority must be between 0 and 255\n");
+                return 1;
+            }
+            client.layer_priority = value;
+        } else if (strcmp(argv[arg], "--opacity") == 0 && arg + 1 < argc) {
+            unsigned value;
+            if (!parse_layer_value(argv[++arg], MAX_OPACITY, value)) {
+                fprintf(stderr, "Error: Opacity must be between 0 and %d\n", MAX_OPACITY);
+                return 1;
+            }
+            client.layer_opacity = value;
+        } else if (strcmp(argv[arg], "--ttl") == 0 && arg + 1 < argc) {
+            unsigned value;
+            if (!parse_layer_value(argv[++arg], DAEMON_MAX_TTL_MS, value)) {
+                fprintf(stderr, "Error: TTL must be between 0 and %d ms\n", DAEMON_MAX_TTL_MS);
+                return 1;
+            }
+            client.layer_ttl_ms = value;
+        } else if (strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc) {
+            fps = atoi(argv[++arg]);
+            if (fps <= 0 || fps > EFFECT_MAX_FPS) {
+                fprintf(stderr, "Error: FPS must be between 1 and %d\n", EFFECT_MAX_FPS);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--duration") == 0 && arg + 1 < argc) {
+            duration_s = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--bench") == 0) {
+            bench_mode = true;
+        } else if (strcmp(argv[arg], "--self-test") == 0) {
+            self_test = true;
+        } else if (strcmp(argv[arg], "--calibrate") == 0) {
+            calibrate = true;
+        } else if (strcmp(argv[arg], "--iterations") == 0 && arg + 1 < argc) {
+            iterations = atoi(argv[++arg]);
+            if (iterations <= 0) {
+                fprintf(stderr, "Error: Iterations must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--dry-run") == 0) {
+            dry_run = true;
+        } else if (strcmp(argv[arg], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[arg], "--cpu") == 0 && arg + 1 < argc) {
+            if (!parse_cpu_list(argv[++arg], realtime.cpus)) {
+                fprintf(stderr, "Error: Invalid CPU list: %s\n", argv[arg]);
+                return 1;
+            }
+            realtime.pin = true;
+        } else if (strcmp(argv[arg], "--rt-priority") == 0 && arg + 1 < argc) {
+            realtime.priority = atoi(argv[++arg]);
+            int max_priority = sched_get_priority_max(SCHED_FIFO);
+            if (realtime.priority < 1 || realtime.priority > max_priority) {
+                fprintf(stderr, "Error: Real-time priority must be between 1 and %d\n", max_priority);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--mlock") == 0) {
+            realtime.lock_memory = true;
+        } else {
+            fprintf(stderr, "Error: Unknown option: %s\n", argv[arg]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (self_test) {
+        return run_self_test(iterations);
+    }
+    bool audio_mode = audio_source != nullptr;
+
+    // Frames sent through a daemon's shared memory need no hardware access
+    bool shm_client = shm_name && !daemon_mode;
+    if (shm_client && (effect_mode || audio_mode || bench_mode || calibrate || batch_mode)) {
+        fprintf(stderr, "Error: --shm only works with --daemon or a frame\n");
+        return 1;
+    }
+
+    // The watcher goes through AE5Device, so it uses the daemon when one runs
+    if (watch_path) {
+        if (daemon_mode || effect_mode || audio_mode || bench_mode || calibrate || batch_mode || shm_client ||
+            dry_run || arg < argc) {
+            fprintf(stderr, "Error: --watch takes no frame and cannot be combined with other modes\n");
+            return 1;
+        }
+        client.socket_path = socket_path;
+        return run_watch(watch_path, client, brightness);
+    }
+
+    // Recording only reads frames from the daemon, so it needs no root either
+    if (record_path) {
+        if (daemon_mode || effect_mode || audio_mode || bench_mode || calibrate || batch_mode || shm_client ||
+            dry_run || arg < argc) {
+            fprintf(stderr, "Error: --record takes no frame and cannot be combined with other modes\n");
+            return 1;
+        }
+        return run_record(record_path, socket_path, record_card, fps, duration_s);
+    }
+
+    // Without root, a single frame can still go through a running daemon.
+    // Layers only exist in the daemon, so a frame for one always goes there.
+    bool one_shot = !daemon_mode && !effect_mode && !audio_mode && !bench_mode && !calibrate && !batch_mode;
+    bool layer_options = client.layer_priority >= 0 || client.layer_opacity >= 0 || client.layer_ttl_ms > 0;
+    if ((layer_options && !client.layer) || (client.layer && (!one_shot || dry_run || shm_client))) {
+        fprintf(stderr, "Error: --priority, --opacity and --ttl need --layer, which only sends a frame to the daemon\n");
+        return 1;
+    }
+    if (one_shot && !dry_run && !shm_client && (client.layer || !check_root_privileges())) {
+        client.mode = DEVICE_DAEMON;
+        client.socket_path = socket_path;
+        return run_client(argc - arg + 1, argv + arg - 1, client, brightness, force, fade_ms);
+    }
+
+    // Dry runs never touch the hardware
+    if (!dry_run && !shm_client && !check_root_privileges()) {
         fprintf(stderr, "Error: This program requires root privileges to access hardware.\n");
         fprintf(stderr, "Please run with sudo or as root user.\n");
         return 1;
     }
 
-    if (argc < 2) {
+    // The frame arguments, with the program name in front for the parser
+    int frame_argc = argc - arg + 1;
+    char** frame_argv = argv + arg - 1;
+    frame_argv[0] = argv[0];
+
+    effect.brightness = brightness;
+    if (keyframe_path && !load_keyframes(keyframe_path, effect)) {
+        return 1;
+    }
+    // A show plays once at its own rate unless a duration is given, then loops
+    ScopedMMIO show_mapping(MAP_FAILED, 0);
+    if (show_path) {
+        if (keyframe_path) {
+            fprintf(stderr, "Error: --play and --keyframes cannot be combined\n");
+            return 1;
+        }
+        if (!map_show(show_path, effect, show_mapping)) {
+            return 1;
+        }
+        fps = effect.show_fps;
+        if (duration_s <= 0) {
+            duration_s = effect.show_frames * (1000000000ULL / fps) / 1e9;
+        }
+    }
+
+    if (daemon_mode + effect_mode + audio_mode + bench_mode + calibrate + batch_mode > 1) {
+        fprintf(stderr, "Error: --daemon, --bench, --calibrate, --stdin, --audio and effects cannot be combined\n");
+        return 1;
+    }
+    if (calibrate && dry_run) {
+        fprintf(stderr, "Error: --calibrate needs the real card\n");
+        return 1;
+    }
+
+    if (batch_mode && frame_argc > 1) {
+        fprintf(stderr, "Error: --stdin reads the frames from standard input only\n");
+        return 1;
+    }
+    if (frame_argc < 2 && !daemon_mode && !effect_mode && !audio_mode && !bench_mode && !calibrate && !batch_mode) {
         print_usage(argv[0]);
         return 1;
     }
 
     // Parse LED configurations
-    std::vector<LEDConfig> led_configs;
-    if (!parse_led_configs(argc, argv, led_configs)) {
+    FrameRequest led_configs;
+    if (frame_argc > 1 && !parse_led_configs(frame_argc, frame_argv, led_configs)) {
         return 1;
     }
 
-    // Create a map of LED positions to colors
-    std::map<int, RGB> led_colors;
-    for (const auto& config : led_configs) {
-        if (led_colors.count(config.position) > 0) {
-            fprintf(stderr, "Warning: Multiple colors specified for LED %d. Using the last one.\n", 
-                    config.position);
+    if (shm_client) {
+        SharedFrames* shared = open_shared_frames(shm_name);
+        if (!shared) {
+            fprintf(stderr, "Error: No daemon is sharing frames in /dev/shm%s\n", shm_name);
+            return 1;
+        }
+        CardFrames frames;
+        bool built = build_card_frames(led_configs, shared->num_cards, brightness, frames);
+        bool published = built && publish_shared_frames(shared, frames);
+        munmap(shared, sizeof(SharedFrames));
+        if (built && !published) {
+            fprintf(stderr, "Warning: The shared frame buffer stays locked, sending through the socket\n");
+            client.socket_path = socket_path;
+            return run_client(frame_argc, frame_argv, client, brightness, force, fade_ms);
         }
-        led_colors[config.position] = config.color;
+        return built ? 0 : 1;
     }
 
-    // Open the device with RAII
-    ScopedFD fd(open("/dev/mem", O_RDWR | O_SYNC));
-    if (fd.get() < 0) {
-        perror("Failed to open /dev/mem");
+    // Nothing to do if the LEDs already show these frames. The card count
+    // comes from the saved state, so no discovery is needed for the check.
+    const char* state_path = dry_run ? nullptr : STATE_FILE_PATH;
+    CardFrames last;
+    CardFrames request;
+    bool have_last = load_frame_state(state_path, last);
+    if (one_shot && !force && have_last &&
+        highest_card(led_configs) < (int)last.size() &&
+        build_card_frames(led_configs, last.size(), brightness, request) &&
+        frames_unchanged(request, last)) {
+        return 0;
+    }
+
+    // A root one-shot goes through AE5Device as well, so with a daemon running the
+    // frame is queued behind the daemon's writes instead of clocked in between them
+    if (one_shot && !dry_run) {
+        client.bdfs = device_bdfs;
+        client.verify = verify;
+        client.fade_fps = fps;
+        client.socket_path = socket_path;
+        client.state_path = state_path;
+        return run_client(frame_argc, frame_argv, client, brightness, force, fade_ms);
+    }
+
+    CardList cards;
+    if (dry_run) {
+        if (!open_dry_run_card(cards)) {
+            return 1;
+        }
+    } else if (!open_all_cards(device_bdfs, cards)) {
         return 1;
     }
 
-    // Find MMIO base address
-    uint64_t mmio_base_addr;
-    try {
-        mmio_base_addr = find_mmio_base_address();
-    } catch (const std::runtime_error& e) {
-        fprintf(stderr, "Error: %s\n", e.what());
+    if (verify) {
+        enable_verification(cards);
+    }
+
+    // Scheduling only matters to the long-running writers
+    if ((daemon_mode || effect_mode || audio_mode || bench_mode) && !apply_realtime(realtime, cards)) {
         return 1;
     }
 
-    // Map MMIO region with RAII
-    void* mmio_base = mmap(NULL, MMIO_REGION_SIZE, PROT_READ | PROT_WRITE, 
-                          MAP_SHARED, fd.get(), mmio_base_addr);
-    if (mmio_base == MAP_FAILED) {
-        perror("Failed to map MMIO region");
+    // Build one frame per card (LED positions are mapped to colors)
+    if (!build_card_frames(led_configs, cards.size(), brightness, request)) {
         return 1;
     }
-    ScopedMMIO mmio(mmio_base, MMIO_REGION_SIZE);
 
-    // Send LED data
-    send_start_frame(mmio.get());
+    if (daemon_mode) {
+        // Show the initial frame, if one was given, then keep the mappings for later requests
+        return run_daemon(cards, socket_path, state_path, brightness, led_configs.empty() ? nullptr : &request,
+                          fifo_queue, shm_name, shm_group, metrics_path, fade_ms, fps);
+    }
 
-    // Send color data for each LED
-    for (int led = 0; led < NUM_LEDS; led++) {
-        uint32_t color_value = 0;
-        if (led_colors.count(led) > 0) {
-            color_value = rgb_to_hex(led_colors[led]);
+    if (batch_mode) {
+        return run_batch(cards, state_path, brightness, stdin);
+    }
+
+    if (audio_mode) {
+        return run_audio(cards, state_path, metrics_path, audio_source, request, brightness);
+    }
+
+    if (effect_mode) {
+        return run_effect(cards, state_path, metrics_path, effect, fps, duration_s);
+    }
+
+    if (calibrate) {
+        // The LEDs are left showing a test pattern
+        if (state_path) {
+            unlink(state_path);
         }
-        send_led_color(mmio.get(), color_value);
+        return run_calibration(cards);
     }
 
-    send_end_frame(mmio.get());
+    if (bench_mode) {
+        // Benchmark with the requested frame, or whatever the first card already shows
+        bool restore = have_last && last.size() == cards.size() && last.has(0);
+        if (!request.has(0) && restore) {
+            request.frames[0] = last.frames[0];
+        }
+        int result = run_bench(*cards[0], request.frames[0], iterations);
 
-    return 0;
-}
\ No newline at end of file
+        // The bench frames are not the card's state: the saved frame is written
+        // back the normal way, or the state is dropped when there is none
+        if (restore) {
+            CardFrames previous = last;
+            previous.present = 0x01;
+            send_card_frames(cards, previous);
+        } else if (state_path) {
+            unlink(state_path);
+        }
+        return result;
+    }
+
+    // Send LED data, fading from the saved frames if asked to
+    if (fade_ms > 0 && have_last && last.size() == cards.size()) {
+        fade_card_frames(cards, last, request, fade_ms, fps);
+    } else {
+        send_card_frames(cards, request);
+    }
+    if (!have_last) {
+        last = CardFrames(cards.size());
+    }
+    merge_card_frames(last, request);
+    save_frame_state(state_path, last);
+    return report_write_failures(cards);
+}
@@ -0,0 +1,1454 @@
+#include "ae5rgb.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef AE5_WITH_TRACE
+#include <signal.h>
+#include <sys/syscall.h>
+#endif
+
+bool check_root_privileges() {
+    return (geteuid() == 0);
+}
+
+/*
+ * The files read on the way to the first frame (sysfs attributes and the
+ * caches) are small, so each is read with a single read() into a stack
+ * buffer and parsed in place, without iostreams. The results still land in
+ * strings and vectors (PCIDevice::bdf, CardList), so the path is not free of
+ * allocations, only of per-file ones.
+ */
+
+// Read a whole small file into buf, NUL-terminated; false if it can't be read
+bool read_small_file(const char* path, char* buf, size_t size) {
+    ScopedFD fd(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0) {
+        return false;
+    }
+    ssize_t n = read(fd.get(), buf, size - 1);
+    if (n < 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+// Replace a file through a temporary one, so readers never see half of it
+bool replace_file(const char* path, const std::string& data) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    ScopedFD fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd.get() < 0 || write(fd.get(), data.data(), data.size()) != (ssize_t)data.size()) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return rename(tmp_path.c_str(), path) == 0;
+}
+
+// Check a sysfs ID file such as "vendor" against an ID without the "0x" prefix
+bool pci_id_is(const char* bdf, const char* attribute, const char* id) {
+    char path[256], value[16];
+    snprintf(path, sizeof(path), "%s/%s/%s", PCI_DEVICES_PATH, bdf, attribute);
+    if (!read_small_file(path, value, sizeof(value))) return false;
+    value[strcspn(value, "\n")] = '\0';
+    return strncmp(value, "0x", 2) == 0 && strcmp(value + 2, id) == 0;
+}
+
+// Check that bdf is our card and read the location of its LED register BAR
+bool probe_device(const char* bdf, PCIDevice& device) {
+    if (!pci_id_is(bdf, "vendor", TARGET_VENDOR) || !pci_id_is(bdf, "device", TARGET_DEVICE)) return false;
+
+    // The resource file has one "<start> <end> <flags>" line per region
+    char path[256], resources[1024];
+    snprintf(path, sizeof(path), "%s/%s/resource", PCI_DEVICES_PATH, bdf);
+    if (!read_small_file(path, resources, sizeof(resources))) return false;
+
+    const char* line = resources;
+    for (int region = 0; region < TARGET_REGION && line; region++) {
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    uint64_t start, end;
+    if (line && sscanf(line, "0x%lx 0x%lx", &start, &end) == 2 && start != 0) {
+        device.bdf = bdf;
+        device.bar_start = start;
+        device.bar_end = end;
+        return true;
+    }
+    return false;
+}
+
+// Every matching card, in PCI address order so card numbers stay stable
+std::vector<PCIDevice> scan_for_devices() {
+    DIR* dir = opendir(PCI_DEVICES_PATH);
+    if (!dir) {
+        throw std::runtime_error("Failed to open PCI devices directory");
+    }
+
+    std::vector<PCIDevice> devices;
+    PCIDevice device;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] == '.') continue;
+
+        // Check if this is our target device
+        if (probe_device(entry->d_name, device)) {
+            devices.push_back(device);
+        }
+    }
+    closedir(dir);
+
+    if (devices.empty()) {
+        throw std::runtime_error("Failed to find target device or memory region");
+    }
+    std::sort(devices.begin(), devices.end(),
+              [](const PCIDevice& a, const PCIDevice& b) { return a.bdf < b.bdf; });
+    return devices;
+}
+
+// The discovery cache holds one "<vendor> <device> <bdf> <bar start>" line per card
+bool load_discovery_cache(const char* path, std::vector<PCIDevice>& devices) {
+    char cache[4096];
+    if (!read_small_file(path, cache, sizeof(cache))) {
+        return false;
+    }
+    char* save = nullptr;
+    for (char* line = strtok_r(cache, "\n", &save); line; line = strtok_r(nullptr, "\n", &save)) {
+        char vendor_id[16], device_id[16], bdf[32];
+        uint64_t bar_start;
+        if (sscanf(line, "%15s %15s %31s %lx", vendor_id, device_id, bdf, &bar_start) != 4 ||
+            strcmp(vendor_id, TARGET_VENDOR) != 0 || strcmp(device_id, TARGET_DEVICE) != 0) {
+            return false;
+        }
+
+        // Only trust the entry if the device is still there with the same BAR
+        PCIDevice device;
+        if (!probe_device(bdf, device) || device.bar_start != bar_start) return false;
+        devices.push_back(device);
+    }
+    return !devices.empty();
+}
+
+void save_discovery_cache(const char* path, const std::vector<PCIDevice>& devices) {
+    std::string data;
+    char line[128];
+    for (const auto& device : devices) {
+        snprintf(line, sizeof(line), "%s %s %s 0x%lx\n", TARGET_VENDOR, TARGET_DEVICE, device.bdf.c_str(),
+                 device.bar_start);
+        data += line;
+    }
+    replace_file(path, data);
+}
+
+// Accept "0000:03:00.0" or the short "03:00.0" form
+bool normalize_bdf(const char* str, std::string& bdf) {
+    if (!*str || strspn(str, "0123456789abcdefABCDEF:.") != strlen(str)) return false;
+
+    bdf = str;
+    if (std::count(bdf.begin(), bdf.end(), ':') == 1) {
+        bdf = "0000:" + bdf;
+    }
+    return true;
+}
+
+/**
+ * Find the cards and their LED register BARs. Explicit BDFs skip the scan
+ * entirely; otherwise the discovery cache is tried before falling back to
+ * scanning every PCI device. Cards added after the cache was written are
+ * only found once it is invalidated (it lives in /run, so at the latest on
+ * the next boot).
+ */
+std::vector<PCIDevice> find_mmio_base_addresses(const std::vector<std::string>& bdfs) {
+    AE5_TRACE_SCOPE("find_mmio_base_addresses", -1);
+    std::vector<PCIDevice> devices;
+    if (!bdfs.empty()) {
+        for (const auto& bdf : bdfs) {
+            PCIDevice device;
+            if (!probe_device(bdf.c_str(), device)) {
+                throw std::runtime_error("No AE-5 memory region found at " + bdf);
+            }
+            devices.push_back(device);
+        }
+        return devices;
+    }
+
+    if (load_discovery_cache(DISCOVERY_CACHE_PATH, devices)) {
+        return devices;
+    }
+
+    devices = scan_for_devices();
+    save_discovery_cache(DISCOVERY_CACHE_PATH, devices);
+    return devices;
+}
+
+/**
+ * Map the LED register BAR. The sysfs resource file maps the BAR at offset 0
+ * and works on kernels with CONFIG_STRICT_DEVMEM; /dev/mem at the physical
+ * address is only used if that fails. The mapping stays valid after the
+ * descriptor is closed. Returns MAP_FAILED on error.
+ */
+void* map_device_bar(const PCIDevice& device, size_t& size, bool& write_combining) {
+    AE5_TRACE_SCOPE("map_device_bar", -1);
+    std::string resource_path = std::string(PCI_DEVICES_PATH) + "/" + device.bdf +
+                                "/resource" + std::to_string(TARGET_REGION);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t bar_size = (device.bar_end - device.bar_start + 1 + page_size - 1) & ~(page_size - 1);
+
+    if (device.bar_end > device.bar_start && bar_size >= LED_CONTROL_OFFSET + sizeof(uint32_t)) {
+        // The _wc file only exists for prefetchable BARs
+        ScopedFD fd(write_combining ? open((resource_path + "_wc").c_str(), O_RDWR | O_CLOEXEC) : -1);
+        if (fd.get() < 0) {
+            write_combining = false;
+            fd.reset(open(resource_path.c_str(), O_RDWR | O_CLOEXEC));
+        }
+        if (fd.get() >= 0) {
+            void* base = mmap(NULL, bar_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+            if (base != MAP_FAILED) {
+                size = bar_size;
+                return base;
+            }
+        }
+    }
+    write_combining = false;
+
+    // Fall back to the physical address through /dev/mem
+    ScopedFD fd(open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC));
+    if (fd.get() < 0) {
+        perror("Failed to open /dev/mem");
+        return MAP_FAILED;
+    }
+    void* base = mmap(NULL, MMIO_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd.get(), device.bar_start);
+    if (base == MAP_FAILED) {
+        perror("Failed to map MMIO region");
+    }
+    size = MMIO_REGION_SIZE;
+    return base;
+}
+
+uint32_t rgb_to_hex(const RGB& color) {
+    return (color.blue << 16) | (color.green << 8) | color.red;
+}
+
+// Decimal number of at most max, advancing p past its digits
+bool scan_number(const char*& p, unsigned max, unsigned& value) {
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    unsigned result = 0;
+    while (*p >= '0' && *p <= '9') {
+        result = result * 10 + (*p++ - '0');
+        if (result > max) return false;
+    }
+    value = result;
+    return true;
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// "r,g,b" or "#rrggbb", advancing p past the color
+bool scan_color(const char*& p, RGB& color) {
+    if (*p == '#') {
+        uint32_t value = 0;
+        for (int i = 1; i <= 6; i++) {
+            int digit = hex_digit(p[i]);
+            if (digit < 0) return false;
+            value = (value << 4) | digit;
+        }
+        p += 7;
+        color = RGB(value >> 16, (value >> 8) & 0xFF, value & 0xFF);
+        return true;
+    }
+
+    unsigned r, g, b;
+    if (!scan_number(p, 255, r) || *p++ != ',' || !scan_number(p, 255, g) || *p++ != ',' ||
+        !scan_number(p, 255, b)) {
+        return false;
+    }
+    color = RGB(r, g, b);
+    return true;
+}
+
+bool parse_color(const char* str, RGB& color) {
+    return scan_color(str, color) && *str == '\0';
+}
+
+bool parse_single_color(int argc, char* argv[], RGB& color) {
+    // "<r> <g> <b>", or a single "r,g,b" or "#rrggbb"
+    if (argc == 2) {
+        return parse_color(argv[1], color);
+    }
+    if (argc != 4) return false;
+
+    unsigned r, g, b;
+    const char* p;
+    if (!scan_number(p = argv[1], 255, r) || *p) return false;
+    if (!scan_number(p = argv[2], 255, g) || *p) return false;
+    if (!scan_number(p = argv[3], 255, b) || *p) return false;
+
+    color = RGB(r, g, b);
+    return true;
+}
+
+bool parse_brightness(const char* str, uint8_t& brightness) {
+    unsigned value;
+    if (!scan_number(str, MAX_BRIGHTNESS, value) || *str != '\0') {
+        return false;
+    }
+    brightness = value;
+    return true;
+}
+
+bool parse_fade(const char* str, uint32_t& fade_ms) {
+    unsigned value;
+    if (!scan_number(str, FADE_MAX_MS, value) || *str != '\0') {
+        return false;
+    }
+    fade_ms = value;
+    return true;
+}
+
+/**
+ * Parse one "[<card>:]<position>:<color>[@<brightness>]" token of length
+ * bytes without copying or modifying it, so it works on argv as well as on
+ * a slice of an input line.
+ */
+bool parse_led_token(const char* token, size_t length, LEDConfig& config) {
+    const char* end = token + length;
+    const char* first = (const char*)memchr(token, ':', length);
+    const char* second = first ? (const char*)memchr(first + 1, ':', end - first - 1) : nullptr;
+    if (!first || (second && memchr(second + 1, ':', end - second - 1))) {
+        fprintf(stderr, "Error: Invalid format for LED configuration: %.*s\n", (int)length, token);
+        fprintf(stderr, "Expected format: [<card>:]<position>:<r,g,b> or <r> <g> <b>\n");
+        return false;
+    }
+
+    const char* p = token;
+    unsigned card = 0;
+    config.card = -1;
+    if (second) {
+        if (!scan_number(p, MAX_CARDS - 1, card) || p != first) {
+            fprintf(stderr, "Error: Invalid card number: %.*s\n", (int)(first - token), token);
+            return false;
+        }
+        config.card = card;
+        p++;
+    }
+
+    const char* pos_start = p;
+    const char* pos_end = second ? second : first;
+    unsigned pos;
+    if (!scan_number(p, NUM_LEDS - 1, pos) || p != pos_end) {
+        fprintf(stderr, "Error: Invalid LED position: %.*s\n", (int)(pos_end - pos_start), pos_start);
+        return false;
+    }
+    config.position = pos;
+    p++;
+
+    // Color, then an optional brightness
+    const char* color_start = p;
+    const char* at = (const char*)memchr(p, '@', end - p);
+    const char* color_end = at ? at : end;
+    if (!scan_color(p, config.color) || p != color_end) {
+        fprintf(stderr, "Error: Invalid color format: %.*s\n", (int)(color_end - color_start), color_start);
+        fprintf(stderr, "Expected format: r,g,b (0-255) or #rrggbb\n");
+        return false;
+    }
+
+    config.brightness = -1;
+    if (at) {
+        unsigned brightness;
+        p = at + 1;
+        if (!scan_number(p, MAX_BRIGHTNESS, brightness) || p != end) {
+            fprintf(stderr, "Error: Invalid brightness: %.*s\n", (int)(end - at - 1), at + 1);
+            fprintf(stderr, "Expected format: <position>:<r,g,b>@<brightness> (0-%d)\n", MAX_BRIGHTNESS);
+            return false;
+        }
+        config.brightness = brightness;
+    }
+    return true;
+}
+
+bool parse_led_configs(int argc, char* argv[], FrameRequest& request) {
+    request.clear();
+
+    // First try to parse as a single color for all LEDs
+    RGB single_color;
+    if (parse_single_color(argc, argv, single_color)) {
+        request.set_all(single_color);
+        return true;
+    }
+
+    // If not a single color, parse as individual LED configurations
+    for (int i = 1; i < argc; i++) {
+        LEDConfig config(0, RGB());
+        if (!parse_led_token(argv[i], strlen(argv[i]), config)) {
+            return false;
+        }
+        request.set(config);
+    }
+
+    return true;
+}
+
+// CIE 1976 lightness of a relative luminance and back, both in [0, 1]
+double cie_lightness(double y) {
+    return y <= 0.008856 ? y * 9.033 : 1.16 * cbrt(y) - 0.16;
+}
+
+double cie_luminance(double l) {
+    return l <= 0.08 ? l / 9.033 : pow((l + 0.16) / 1.16, 3);
+}
+
+FadeTables build_fade_tables() {
+    FadeTables tables;
+    for (int i = 0; i < 256; i++) {
+        double x = i / 255.0;
+        tables.gamma_encode[i] = lround(pow(x, 1 / FADE_GAMMA) * 255);
+        tables.gamma_decode[i] = lround(pow(x, FADE_GAMMA) * 255);
+        tables.lightness_encode[i] = lround(cie_lightness(x) * 255);
+        tables.lightness_decode[i] = lround(cie_luminance(x) * 255);
+    }
+    return tables;
+}
+
+// Built on first use, never touched again
+const FadeTables& fade_tables() {
+    static const FadeTables tables = build_fade_tables();
+    return tables;
+}
+
+void encode_soa(const LEDFrame& frame, FrameSoA& soa) {
+    const FadeTables& tables = fade_tables();
+    memset(&soa, 0, sizeof(soa));
+    for (int led = 0; led < NUM_LEDS; led++) {
+        soa.red[led] = tables.gamma_encode[frame.colors[led].red];
+        soa.green[led] = tables.gamma_encode[frame.colors[led].green];
+        soa.blue[led] = tables.gamma_encode[frame.colors[led].blue];
+        soa.brightness[led] = tables.lightness_encode[frame.brightness[led]];
+    }
+}
+
+// Back to the values sent to the card, straight into the frame the compiler takes
+void decode_soa(const FrameSoA& soa, LEDFrame& frame) {
+    const FadeTables& tables = fade_tables();
+    for (int led = 0; led < NUM_LEDS; led++) {
+        frame.colors[led].red = tables.gamma_decode[soa.red[led]];
+        frame.colors[led].green = tables.gamma_decode[soa.green[led]];
+        frame.colors[led].blue = tables.gamma_decode[soa.blue[led]];
+        frame.brightness[led] = tables.lightness_decode[soa.brightness[led]];
+    }
+}
+
+// Highest card number a request addresses, or -1 if it only has settings for every card
+int highest_card(const FrameRequest& request) {
+    for (int card = MAX_CARDS - 1; card >= 0; card--) {
+        if (request.present[card + 1]) return card;
+    }
+    return -1;
+}
+
+// The frame one card gets from a request: card-specific settings override the
+// ones for every card, LEDs without a color are turned off and LEDs without
+// their own brightness use the global one
+void build_frame(const FrameRequest& request, int card, uint8_t brightness, LEDFrame& frame) {
+    int slot = card + 1;
+    for (int led = 0; led < NUM_LEDS; led++) {
+        int source = (request.present[slot] >> led) & 0x01 ? slot : (request.present[0] >> led) & 0x01 ? 0 : -1;
+        frame.colors[led] = source >= 0 ? request.colors[source][led] : RGB();
+        frame.brightness[led] = source >= 0 && request.brightness[source][led] >= 0
+                              ? request.brightness[source][led] : brightness;
+    }
+}
+
+/**
+ * Build the frame of every card a request addresses. Cards the request does
+ * not mention are left alone. Fails if a card does not exist.
+ */
+bool build_card_frames(const FrameRequest& request, size_t num_cards, uint8_t brightness,
+                       CardFrames& card_frames) {
+    if (highest_card(request) >= (int)num_cards) {
+        fprintf(stderr, "Error: Card %d not found (%zu card(s) present)\n", highest_card(request), num_cards);
+        return false;
+    }
+
+    card_frames.num_cards = num_cards;
+    card_frames.present = 0;
+    for (size_t card = 0; card < num_cards; card++) {
+        if (!(request.present[0] | request.present[card + 1])) continue;
+        build_frame(request, card, brightness, card_frames.frames[card]);
+        card_frames.present |= 1 << card;
+    }
+    return true;
+}
+
+// Parse a line in the command-line frame syntax; the line is not modified
+bool parse_frame_line(const char* line, FrameRequest& request) {
+    request.clear();
+
+    // A lone color or "<r> <g> <b>" sets every LED of every card
+    const char* tokens[3];
+    int count = 0;
+    for (const char* p = line; *p;) {
+        while (is_blank(*p)) p++;
+        if (!*p) break;
+        if (count < 3) tokens[count] = p;
+        count++;
+        while (*p && !is_blank(*p)) p++;
+    }
+
+    RGB single;
+    bool is_single = false;
+    const char* p;
+    if (count == 1) {
+        p = tokens[0];
+        is_single = scan_color(p, single) && (!*p || is_blank(*p));
+    } else if (count == 3) {
+        unsigned rgb[3];
+        is_single = true;
+        for (int i = 0; i < 3 && is_single; i++) {
+            p = tokens[i];
+            is_single = scan_number(p, 255, rgb[i]) && (!*p || is_blank(*p));
+        }
+        single = RGB(rgb[0], rgb[1], rgb[2]);
+    }
+    if (is_single) {
+        request.set_all(single);
+        return true;
+    }
+
+    for (p = line; *p;) {
+        while (is_blank(*p)) p++;
+        if (!*p) break;
+        const char* start = p;
+        while (*p && !is_blank(*p)) p++;
+
+        LEDConfig config(0, RGB());
+        if (!parse_led_token(start, p - start, config)) {
+            return false;
+        }
+        request.set(config);
+    }
+    return true;
+}
+
+// True if every card the request addresses already shows its frame
+bool frames_unchanged(const CardFrames& request, const CardFrames& last) {
+    if (request.size() != last.size() || (request.present & ~last.present)) return false;
+    for (size_t card = 0; card < request.size(); card++) {
+        if (request.has(card) && !same_frame(request.frames[card], last.frames[card])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only the cards whose frame would change
+CardFrames changed_frames(const CardFrames& request, const CardFrames& last) {
+    CardFrames changed = request;
+    for (size_t card = 0; card < request.size() && card < last.size(); card++) {
+        if (last.has(card) && same_frame(request.frames[card], last.frames[card])) {
+            changed.present &= ~(1 << card);
+        }
+    }
+    return changed;
+}
+
+void merge_card_frames(CardFrames& last, const CardFrames& committed) {
+    if (last.size() != committed.size()) {
+        last = CardFrames(committed.size());
+    }
+    for (size_t card = 0; card < committed.size(); card++) {
+        if (committed.has(card)) {
+            last.set(card, committed.frames[card]);
+        }
+    }
+}
+
+Metrics g_metrics;
+
+#ifdef AE5_WITH_TRACE
+std::atomic<bool> g_trace_enabled{false};
+
+static TraceEvent g_trace_ring[TRACE_EVENTS];
+static std::atomic<uint64_t> g_trace_next{0};
+static std::atomic<bool> g_trace_dumped{false};
+static const char* g_trace_path;
+static uint64_t g_trace_start_ticks;
+static uint64_t g_trace_start_ns;
+static volatile sig_atomic_t g_trace_signal = 0;
+
+void trace_record(const char* name, uint64_t start, int32_t arg) {
+    static thread_local uint32_t tid = 0;
+    if (tid == 0) tid = syscall(SYS_gettid);
+
+    // Writers never wait for each other; the oldest events are overwritten
+    TraceEvent& event = g_trace_ring[g_trace_next.fetch_add(1, std::memory_order_relaxed) & (TRACE_EVENTS - 1)];
+    event.name = name;
+    event.start = start;
+    event.end = trace_clock();
+    event.arg = arg;
+    event.tid = tid;
+}
+
+// Ticks per microsecond, measured against CLOCK_MONOTONIC_RAW since
+// trace_start(). Waits until 10 ms have passed, so short runs are not skewed.
+static double trace_ticks_per_us() {
+    uint64_t ticks, ns;
+    do {
+        ticks = trace_clock();
+        ns = raw_ns();
+    } while (ns - g_trace_start_ns < 10000000);
+    return (double)(ticks - g_trace_start_ticks) * 1000.0 / (ns - g_trace_start_ns);
+}
+
+// At exit, or on the trace thread after a signal; never in a signal handler
+static void trace_dump() {
+    if (g_trace_dumped.exchange(true)) return;
+    g_trace_enabled.store(false);
+
+    ScopedFD fd(open(g_trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd.get() < 0) return;
+
+    double ticks_per_us = trace_ticks_per_us();
+    uint64_t end = g_trace_next.load();
+    uint64_t first = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    char line[256];
+    int pid = getpid();
+    ssize_t ignored = write(fd.get(), "{\"traceEvents\":[\n", 17);
+    for (uint64_t i = first; i < end; i++) {
+        const TraceEvent& event = g_trace_ring[i & (TRACE_EVENTS - 1)];
+        int n = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"pid\":%d,\"tid\":%u",
+                         i > first ? ",\n" : "", event.name, (event.start - g_trace_start_ticks) / ticks_per_us,
+                         (event.end - event.start) / ticks_per_us, pid, event.tid);
+        if (event.arg >= 0) {
+            n += snprintf(line + n, sizeof(line) - n, ",\"args\":{\"n\":%d}", event.arg);
+        }
+        line[n++] = '}';
+        ignored = write(fd.get(), line, n);
+    }
+    ignored = write(fd.get(), "\n]}\n", 4);
+    (void)ignored;
+}
+
+// Count, median, 99th percentile and worst case of every span name
+static void print_trace_summary() {
+    double ticks_per_us = trace_ticks_per_us();
+    uint64_t end = g_trace_next.load();
+    std::map<std::string, std::vector<double>> spans;
+    for (uint64_t i = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0; i < end; i++) {
+        const TraceEvent& event = g_trace_ring[i & (TRACE_EVENTS - 1)];
+        spans[event.name].push_back((event.end - event.start) / ticks_per_us);
+    }
+    if (spans.empty()) return;
+
+    fprintf(stderr, "%-26s %8s %10s %10s %10s\n", "span", "count", "p50 (us)", "p99 (us)", "max (us)");
+    for (auto& entry : spans) {
+        std::vector<double>& samples = entry.second;
+        std::sort(samples.begin(), samples.end());
+        fprintf(stderr, "%-26s %8zu %10.2f %10.2f %10.2f\n", entry.first.c_str(), samples.size(),
+                samples[samples.size() / 2], samples[(samples.size() - 1) * 99 / 100], samples.back());
+    }
+}
+
+static void trace_at_exit() {
+    if (!g_trace_dumped.load()) {
+        print_trace_summary();
+        trace_dump();
+        fprintf(stderr, "Trace written to %s\n", g_trace_path);
+    }
+}
+
+// Only records the signal; the trace thread writes the dump. Returning from a
+// fault would repeat it, so the faulting thread waits here until then.
+static void trace_signal(int sig) {
+    g_trace_signal = sig;
+    if (sig != SIGINT && sig != SIGTERM) {
+        for (;;) pause();
+    }
+}
+
+// Wait for a signal caught by trace_signal(), dump the ring outside the handler
+// and raise the signal again, now with its default action
+static void trace_watch_signals() {
+    const struct timespec interval = {0, 20000000};
+    while (!g_trace_signal) {
+        nanosleep(&interval, nullptr);
+    }
+    int sig = g_trace_signal;
+    trace_dump();
+    fprintf(stderr, "Trace written to %s\n", g_trace_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void trace_start(const char* path) {
+    g_trace_path = path;
+    g_trace_start_ticks = trace_clock();
+    g_trace_start_ns = raw_ns();
+    atexit(trace_at_exit);
+
+    // Crashes dump the ring too. Programs that handle SIGINT and SIGTERM
+    // themselves exit normally, so those are only taken while unhandled.
+    std::thread(trace_watch_signals).detach();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGSEGV, SIGBUS, SIGABRT, SIGINT, SIGTERM}) {
+        struct sigaction old;
+        if (sigaction(sig, nullptr, &old) == 0 && old.sa_handler == SIG_DFL) {
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+    g_trace_enabled.store(true);
+}
+#endif
+
+// The calibration file holds one "<bdf> <spacing> <encoding> <write combining>"
+// line per calibrated card (older files lack the last field); found(bdf, timing)
+// is called for each valid line. Lines naming ENCODING_SKIP_CLOCK_LOW, which
+// older versions could pick, are dropped so those cards fall back to the default
+template <typename Found>
+void read_calibration(const char* path, Found found) {
+    char data[4096];
+    if (!read_small_file(path, data, sizeof(data))) {
+        return;
+    }
+    char* save = nullptr;
+    for (char* line = strtok_r(data, "\n", &save); line; line = strtok_r(nullptr, "\n", &save)) {
+        char bdf[32];
+        int spacing, encoding, write_combining = 0;
+        if (sscanf(line, "%31s %d %d %d", bdf, &spacing, &encoding, &write_combining) >= 3 &&
+            spacing >= 0 && spacing <= CALIBRATION_MAX_SPACING &&
+            encoding >= ENCODING_FULL && encoding <= ENCODING_MERGED &&
+            encoding != ENCODING_SKIP_CLOCK_LOW) {
+            found(bdf, FrameTiming(spacing, (FrameEncoding)encoding, write_combining == 1));
+        }
+    }
+}
+
+std::map<std::string, FrameTiming> load_calibration(const char* path) {
+    std::map<std::string, FrameTiming> timings;
+    read_calibration(path, [&](const char* bdf, const FrameTiming& timing) { timings[bdf] = timing; });
+    return timings;
+}
+
+void save_calibration(const char* path, const std::map<std::string, FrameTiming>& timings) {
+    std::string data;
+    for (const auto& entry : timings) {
+        data += entry.first + " " + std::to_string(entry.second.spacing) + " " +
+                std::to_string((int)entry.second.encoding) + " " +
+                std::to_string((int)entry.second.write_combining) + "\n";
+    }
+    replace_file(path, data);
+}
+
+bool open_cards(const std::vector<PCIDevice>& devices, CardList& cards) {
+    // The calibration decides which mapping each card gets
+    std::vector<FrameTiming> timings(devices.size());
+    read_calibration(CALIBRATION_FILE_PATH, [&](const char* bdf, const FrameTiming& timing) {
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (devices[i].bdf == bdf) timings[i] = timing;
+        }
+    });
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        size_t mmio_size;
+        bool write_combining = timings[i].write_combining;
+        void* mmio_base = map_device_bar(devices[i], mmio_size, write_combining);
+        if (mmio_base == MAP_FAILED) {
+            return false;
+        }
+        cards.emplace_back(new Card(devices[i], mmio_base, mmio_size, write_combining));
+        cards.back()->timing = timings[i];
+        cards.back()->timing.write_combining = write_combining;
+    }
+    return true;
+}
+
+bool remap_card(Card& card, bool write_combining) {
+    size_t mmio_size;
+    void* mmio_base = map_device_bar(card.device, mmio_size, write_combining);
+    if (mmio_base == MAP_FAILED) {
+        return false;
+    }
+    card.mmio.reset(mmio_base, mmio_size);
+    card.io = MMIOBackend(mmio_base, write_combining);
+    card.timing.write_combining = write_combining;
+    return true;
+}
+
+bool reopen_card(Card& card) {
+    PCIDevice device;
+    if (!probe_device(card.device.bdf.c_str(), device)) {
+        return false;
+    }
+    // Only the BAR changes; the address stays the same for readers of bdf
+    card.device.bar_start = device.bar_start;
+    card.device.bar_end = device.bar_end;
+    if (!remap_card(card, card.timing.write_combining)) {
+        return false;
+    }
+    g_metrics.card_remaps.add();
+    return true;
+}
+
+// Find and map every card (or the ones in bdfs), reporting errors on stderr
+bool open_all_cards(const std::vector<std::string>& bdfs, CardList& cards) {
+    std::vector<PCIDevice> devices;
+    uint64_t start = raw_ns();
+    try {
+        devices = find_mmio_base_addresses(bdfs);
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return false;
+    }
+    uint64_t found = raw_ns();
+    g_metrics.discovery_ns.add(found - start);
+    if (devices.size() > MAX_CARDS) {
+        fprintf(stderr, "Warning: Found %zu cards, only driving the first %d\n", devices.size(), MAX_CARDS);
+        devices.resize(MAX_CARDS);
+    }
+
+    if (!open_cards(devices, cards)) {
+        return false;
+    }
+    g_metrics.mapping_ns.add(raw_ns() - found);
+    return true;
+}
+
+/**
+ * Every encoding leaves LED_CONTROL_OFFSET at LED_CLOCK_LOW. With verification
+ * on, the register is read back after each frame and anything else (a card
+ * that dropped off the bus reads all ones) sends the frame again, up to
+ * WRITE_ITERATIONS times in total. The readback also waits for the posted
+ * stores to land, so the check costs one bus round trip per frame.
+ */
+void send_card_frame(Card& card, const LEDFrame& frame) {
+    uint64_t start = raw_ns();
+    const CompiledFrame& compiled = card.cache.get(frame);
+    uint64_t encoded = raw_ns();
+    card.stats.encode.record(encoded - start);
+    card.stats.frames.add();
+
+    for (int attempt = 0; attempt < WRITE_ITERATIONS; attempt++) {
+        AE5_TRACE_SCOPE("send_card_frame", attempt);
+        if (attempt > 0) card.stats.retries.add();
+        stream_frame(card.io, compiled, card.timing);
+        if (!card.verify || card.io.read(LED_CONTROL_OFFSET) == LED_CLOCK_LOW) {
+            card.stats.write.record(raw_ns() - encoded);
+            return;
+        }
+    }
+    card.stats.write.record(raw_ns() - encoded);
+    card.stats.failures.add();
+}
+
+// Verification needs a register that reads back what was written. LED_CLOCK_LOW
+// is the idle state between frames, so writing it is harmless.
+void enable_verification(CardList& cards) {
+    for (size_t i = 0; i < cards.size(); i++) {
+        Card& card = *cards[i];
+        card.io.write(LED_CONTROL_OFFSET, LED_CLOCK_LOW);
+        uint32_t readback = card.io.read(LED_CONTROL_OFFSET);
+        if (readback == LED_CLOCK_LOW) {
+            card.verify = true;
+        } else {
+            fprintf(stderr, "Warning: Card %zu reads back 0x%08x, not verifying its frames\n", i, readback);
+        }
+    }
+}
+
+void print_write_stats(const CardList& cards) {
+    for (size_t i = 0; i < cards.size(); i++) {
+        const Card& card = *cards[i];
+        if (!card.verify) continue;
+        fprintf(stderr, "Card %zu (%s): %llu frames, %llu retries, %llu failed\n", i, card.device.bdf.c_str(),
+                (unsigned long long)card.stats.frames.value(), (unsigned long long)card.stats.retries.value(),
+                (unsigned long long)card.stats.failures.value());
+    }
+}
+
+void append_metric(std::string& out, const char* name, const char* type, const char* help) {
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+void append_sample(std::string& out, const char* name, const char* labels, double sample) {
+    char number[32];
+    snprintf(number, sizeof(number), " %.9g\n", sample);
+    out += name;
+    out += labels;
+    out += number;
+}
+
+void append_histogram(std::string& out, const char* name, const char* labels, const LatencyHistogram& histogram) {
+    char suffixed[128];
+    char bucket_labels[192];
+    uint64_t cumulative = 0;
+    snprintf(suffixed, sizeof(suffixed), "%s_bucket", name);
+    for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+        cumulative += histogram.buckets[bucket].value();
+        if (bucket < METRICS_BUCKETS - 1) {
+            snprintf(bucket_labels, sizeof(bucket_labels), "{%s,le=\"%g\"}", labels, (1000ULL << bucket) / 1e9);
+        } else {
+            snprintf(bucket_labels, sizeof(bucket_labels), "{%s,le=\"+Inf\"}", labels);
+        }
+        append_sample(out, suffixed, bucket_labels, cumulative);
+    }
+    snprintf(bucket_labels, sizeof(bucket_labels), "{%s}", labels);
+    snprintf(suffixed, sizeof(suffixed), "%s_sum", name);
+    append_sample(out, suffixed, bucket_labels, histogram.sum_ns.value() / 1e9);
+    snprintf(suffixed, sizeof(suffixed), "%s_count", name);
+    append_sample(out, suffixed, bucket_labels, cumulative);
+}
+
+// Render every metric in the Prometheus text exposition format
+std::string format_metrics(const CardList& cards) {
+    std::string out;
+    std::vector<std::string> labels;
+    for (size_t i = 0; i < cards.size(); i++) {
+        labels.push_back("card=\"" + std::to_string(i) + "\",bdf=\"" + cards[i]->device.bdf + "\"");
+    }
+
+    append_metric(out, "ae5_discovery_seconds", "gauge", "Time spent finding the cards.");
+    append_sample(out, "ae5_discovery_seconds", "", g_metrics.discovery_ns.value() / 1e9);
+    append_metric(out, "ae5_mapping_seconds", "gauge", "Time spent mapping the card registers.");
+    append_sample(out, "ae5_mapping_seconds", "", g_metrics.mapping_ns.value() / 1e9);
+    append_metric(out, "ae5_requests_total", "counter", "Daemon requests received.");
+    append_sample(out, "ae5_requests_total", "", g_metrics.requests.value());
+    append_metric(out, "ae5_request_errors_total", "counter", "Daemon requests rejected.");
+    append_sample(out, "ae5_request_errors_total", "", g_metrics.request_errors.value());
+    append_metric(out, "ae5_coalesced_total", "counter", "Daemon updates replaced by a newer one before being written.");
+    append_sample(out, "ae5_coalesced_total", "", g_metrics.coalesced.value());
+    append_metric(out, "ae5_effect_missed_deadlines_total", "counter", "Effect frames that finished late.");
+    append_sample(out, "ae5_effect_missed_deadlines_total", "", g_metrics.missed_deadlines.value());
+    append_metric(out, "ae5_effect_dropped_frames_total", "counter", "Effect frames skipped to catch up.");
+    append_sample(out, "ae5_effect_dropped_frames_total", "", g_metrics.dropped_frames.value());
+    append_metric(out, "ae5_shared_updates_total", "counter", "Card frames taken from the shared memory region.");
+    append_sample(out, "ae5_shared_updates_total", "", g_metrics.shared_updates.value());
+    append_metric(out, "ae5_card_remaps_total", "counter", "Cards mapped again after being removed or rebound.");
+    append_sample(out, "ae5_card_remaps_total", "", g_metrics.card_remaps.value());
+    append_metric(out, "ae5_resumes_total", "counter", "Frames sent again after the system resumed.");
+    append_sample(out, "ae5_resumes_total", "", g_metrics.resumes.value());
+
+    struct {
+        const char* name;
+        const char* help;
+        MetricCounter WriteStats::*field;
+    } counters[] = {
+        {"ae5_frames_total", "Frames written to the card.", &WriteStats::frames},
+        {"ae5_frame_retries_total", "Frames sent again after a failed readback.", &WriteStats::retries},
+        {"ae5_frame_failures_total", "Frames never confirmed by a readback.", &WriteStats::failures},
+    };
+    for (const auto& counter : counters) {
+        append_metric(out, counter.name, "counter", counter.help);
+        for (size_t i = 0; i < cards.size(); i++) {
+            append_sample(out, counter.name, ("{" + labels[i] + "}").c_str(), (cards[i]->stats.*counter.field).value());
+        }
+    }
+
+    append_metric(out, "ae5_frame_cache_hits_total", "counter", "Frames found already encoded.");
+    for (size_t i = 0; i < cards.size(); i++) {
+        append_sample(out, "ae5_frame_cache_hits_total", ("{" + labels[i] + "}").c_str(), cards[i]->cache.hits.value());
+    }
+    append_metric(out, "ae5_frame_cache_misses_total", "counter", "Frames that had to be encoded.");
+    for (size_t i = 0; i < cards.size(); i++) {
+        append_sample(out, "ae5_frame_cache_misses_total", ("{" + labels[i] + "}").c_str(), cards[i]->cache.misses.value());
+    }
+
+    append_metric(out, "ae5_frame_encode_seconds", "histogram", "Time to look up or encode a frame.");
+    for (size_t i = 0; i < cards.size(); i++) {
+        append_histogram(out, "ae5_frame_encode_seconds", labels[i].c_str(), cards[i]->stats.encode);
+    }
+    append_metric(out, "ae5_frame_write_seconds", "histogram",
+                  "Time to clock a frame out to the card, including readback and retries.");
+    for (size_t i = 0; i < cards.size(); i++) {
+        append_histogram(out, "ae5_frame_write_seconds", labels[i].c_str(), cards[i]->stats.write);
+    }
+    return out;
+}
+
+// Replace the metrics file atomically, so a collector never reads half of it
+void write_metrics_file(const char* path, const CardList& cards) {
+    if (!path) {
+        return;
+    }
+    if (!replace_file(path, format_metrics(cards))) {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+    }
+}
+
+/**
+ * The thread that writes one card's frame while the caller writes another
+ * card's. It lives as long as the card, so a fade or show across several
+ * cards costs two wakeups per card and frame rather than a new thread.
+ */
+class CardWorker {
+public:
+    explicit CardWorker(Card& card) : card_(card), thread_([this] { run(); }) {}
+
+    ~CardWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeup_.notify_all();
+        thread_.join();
+    }
+
+    void start(const LEDFrame& frame) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            frame_ = frame;
+            pending_ = true;
+        }
+        wakeup_.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wakeup_.wait(lock, [this] { return !pending_; });
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wakeup_.wait(lock, [this] { return pending_ || stop_; });
+            if (stop_) return;
+            lock.unlock();
+            send_card_frame(card_, frame_);
+            lock.lock();
+            pending_ = false;
+            wakeup_.notify_all();
+        }
+    }
+
+    Card& card_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_; // a frame to send, the frame sent, or stop
+    LEDFrame frame_;
+    bool pending_ = false;
+    bool stop_ = false;
+    std::thread thread_; // last, so it starts after everything it uses
+};
+
+Card::Card(const PCIDevice& d, void* base, size_t size, bool write_combining)
+    : device(d), mmio(base, size), io(base, write_combining) {}
+
+Card::~Card() = default;
+
+// Write the present frames. The first card in the request is written inline
+// and the others by their workers, so an update takes as long as one frame.
+void send_card_frames(CardList& cards, const CardFrames& card_frames) {
+    Card* inline_card = nullptr;
+    const LEDFrame* inline_frame = nullptr;
+    uint8_t started = 0;
+
+    for (size_t i = 0; i < cards.size() && i < card_frames.size(); i++) {
+        if (!card_frames.has(i)) continue;
+
+        Card& card = *cards[i];
+        if (!inline_card) {
+            inline_card = &card;
+            inline_frame = &card_frames.frames[i];
+            continue;
+        }
+        if (!card.worker) {
+            card.worker.reset(new CardWorker(card));
+        }
+        card.worker->start(card_frames.frames[i]);
+        started |= 1 << i;
+    }
+
+    if (inline_card) {
+        send_card_frame(*inline_card, *inline_frame);
+    }
+    for (size_t i = 0; i < cards.size(); i++) {
+        if ((started >> i) & 0x01) cards[i]->worker->wait();
+    }
+}
+
+// On-disk copy of the last committed frames. /run is cleared on boot,
+// which is also when the LEDs lose their state; the LEDs also go dark
+// over suspend, so the file records the boot and the time slept so far
+// and is only trusted while both still match.
+struct FrameStateHeader {
+    uint32_t magic;
+    uint32_t num_cards;
+    uint64_t suspended_ns;
+    char boot_id[40];
+};
+
+// The kernel's random UUID for this boot, zero-padded
+static void read_boot_id(char (&boot_id)[40]) {
+    memset(boot_id, 0, sizeof(boot_id));
+    if (read_small_file("/proc/sys/kernel/random/boot_id", boot_id, sizeof(boot_id))) {
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+    }
+}
+
+struct CardFrameState {
+    uint8_t valid;
+    LEDFrame frame;
+};
+
+// A null path disables the state file (dry runs never touch the real one)
+bool load_frame_state(const char* path, CardFrames& state) {
+    if (!path) {
+        return false;
+    }
+
+    ScopedFD fd(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0) {
+        return false;
+    }
+
+    FrameStateHeader header;
+    if (read(fd.get(), &header, sizeof(header)) != sizeof(header) || header.magic != STATE_FILE_MAGIC ||
+        header.num_cards == 0 || header.num_cards > MAX_CARDS) {
+        return false;
+    }
+    char boot_id[40];
+    read_boot_id(boot_id);
+    if (memcmp(header.boot_id, boot_id, sizeof(boot_id)) != 0 ||
+        suspended_ns() > header.suspended_ns + SUSPEND_SLACK_NS) {
+        return false;
+    }
+
+    CardFrameState entries[MAX_CARDS];
+    ssize_t size = sizeof(CardFrameState) * header.num_cards;
+    if (read(fd.get(), entries, size) != size) {
+        return false;
+    }
+
+    state = CardFrames(header.num_cards);
+    for (size_t card = 0; card < header.num_cards; card++) {
+        state.frames[card] = entries[card].frame;
+        if (entries[card].valid) state.present |= 1 << card;
+    }
+    return true;
+}
+
+void save_frame_state(const char* path, const CardFrames& state) {
+    if (!path || state.size() == 0 || state.size() > MAX_CARDS) {
+        return;
+    }
+
+    FrameStateHeader header;
+    header.magic = STATE_FILE_MAGIC;
+    header.num_cards = state.size();
+    header.suspended_ns = suspended_ns();
+    read_boot_id(header.boot_id);
+    CardFrameState entries[MAX_CARDS];
+    for (size_t card = 0; card < state.size(); card++) {
+        entries[card].valid = state.has(card);
+        entries[card].frame = state.frames[card];
+    }
+
+    // Write a temporary file and rename it so readers never see a partial frame
+    std::string tmp_path = std::string(path) + ".tmp";
+    ScopedFD fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    ssize_t size = sizeof(CardFrameState) * state.size();
+    if (fd.get() < 0 || write(fd.get(), &header, sizeof(header)) != sizeof(header) ||
+        write(fd.get(), entries, size) != size) {
+        unlink(tmp_path.c_str());
+        return;
+    }
+    rename(tmp_path.c_str(), path);
+}
+
+/**
+ * Fade the cards from the frames they show to the requested ones, one step
+ * every 1/fps seconds. Cards whose frame is not known get the new one at once.
+ */
+void fade_card_frames(CardList& cards, const CardFrames& shown, const CardFrames& request, uint32_t fade_ms,
+                      int fps) {
+    const uint64_t period_ns = 1000000000ULL / fps;
+    uint64_t deadline = monotonic_ns();
+    Transition transitions[MAX_CARDS];
+    uint8_t fading = 0;
+    CardFrames step(cards.size());
+    for (size_t card = 0; card < request.size(); card++) {
+        if (!request.has(card)) continue;
+        if (shown.has(card)) {
+            transitions[card].begin(shown.frames[card], request.frames[card], deadline, fade_ms * 1000000ULL);
+            fading |= 1 << card;
+        } else {
+            step.set(card, request.frames[card]);
+        }
+    }
+
+    CardFrames last = shown;
+    while (step.present || fading) {
+        uint64_t now = monotonic_ns();
+        LEDFrame frame;
+        for (size_t card = 0; card < cards.size(); card++) {
+            if (!((fading >> card) & 0x01)) continue;
+            transitions[card].render(now, frame);
+            step.set(card, frame);
+            if (!transitions[card].active) {
+                fading &= ~(1 << card);
+            }
+        }
+        if (!frames_unchanged(step, last)) {
+            send_card_frames(cards, step);
+            merge_card_frames(last, step);
+        }
+        step.present = 0;
+
+        deadline += period_ns;
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (fading && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+    }
+}
+
+int connect_daemon_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    ScopedFD sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (sock.get() < 0 || connect(sock.get(), (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        return -1;
+    }
+    return sock.release();
+}
+
+bool parse_layer_name(const char* str) {
+    if (!*str || strlen(str) > DAEMON_LAYER_NAME_MAX) return false;
+    for (const char* p = str; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_' && *p != '.') return false;
+    }
+    return true;
+}
+
+bool parse_frame_reply(const char* line, size_t card, LEDFrame& frame) {
+    const char* p = line;
+    for (int led = 0; led < NUM_LEDS; led++) {
+        while (is_blank(*p)) p++;
+        const char* end = p;
+        while (*end && !is_blank(*end)) end++;
+        LEDConfig config(0, RGB());
+        if (end == p || !parse_led_token(p, end - p, config) || config.card != (int)card ||
+            config.position != led || config.brightness < 0) {
+            return false;
+        }
+        frame.colors[led] = config.color;
+        frame.brightness[led] = config.brightness;
+        p = end;
+    }
+    while (is_blank(*p)) p++;
+    return *p == '\0';
+}
+
+std::unique_ptr<AE5Device> AE5Device::open(const AE5DeviceOptions& options) {
+    // The name goes into every request line, so it must be a single word
+    if (options.layer && !parse_layer_name(options.layer)) {
+        fprintf(stderr, "Error: Invalid layer name: %s\n", options.layer);
+        return nullptr;
+    }
+    int daemon_fd = -1;
+    if (options.mode != DEVICE_DIRECT) {
+        daemon_fd = connect_daemon_socket(options.socket_path);
+        if (daemon_fd < 0 && (options.mode == DEVICE_DAEMON || options.layer)) {
+            fprintf(stderr, "Error: No daemon is listening on %s\n", options.socket_path);
+            return nullptr;
+        }
+    }
+    if (daemon_fd < 0 && !check_root_privileges()) {
+        fprintf(stderr, "Error: Setting the LEDs needs root privileges or a daemon on %s\n", options.socket_path);
+        return nullptr;
+    }
+
+    std::unique_ptr<AE5Device> device(new AE5Device(daemon_fd, options));
+    if (daemon_fd >= 0) {
+        // The daemon tells how many cards it drives
+        const char request[] = "cards\n";
+        std::string count_reply, reply;
+        unsigned num_cards = 0;
+        bool ok = send(daemon_fd, request, sizeof(request) - 1, MSG_NOSIGNAL) == sizeof(request) - 1 &&
+                  device->read_reply(count_reply) && device->read_reply(reply) && reply == "OK";
+        const char* p = count_reply.c_str();
+        if (!ok || !scan_number(p, MAX_CARDS, num_cards) || *p != '\0') {
+            fprintf(stderr, "Error: The daemon on %s did not report its cards\n", options.socket_path);
+            return nullptr;
+        }
+        device->shown_ = CardFrames(num_cards);
+
+        // set_led() builds on the frame shown, so start from the daemon's frames
+        // without the layers (a layer handle only ever sends its own LEDs)
+        for (unsigned card = 0; card < num_cards && !options.layer; card++) {
+            char frame_request[32];
+            int length = snprintf(frame_request, sizeof(frame_request), "frame %u base\n", card);
+            std::string frame_reply;
+            LEDFrame frame;
+            if (send(daemon_fd, frame_request, length, MSG_NOSIGNAL) != length || !device->read_reply(frame_reply) ||
+                !device->read_reply(reply) || reply != "OK" || !parse_frame_reply(frame_reply.c_str(), card, frame)) {
+                fprintf(stderr, "Error: The daemon on %s did not report the frame of card %u\n",
+                        options.socket_path, card);
+                return nullptr;
+            }
+            device->shown_.set(card, frame);
+        }
+    } else {
+        if (!open_all_cards(options.bdfs, device->cards_)) {
+            return nullptr;
+        }
+        if (options.verify) {
+            enable_verification(device->cards_);
+        }
+        if (!load_frame_state(options.state_path, device->shown_) || device->shown_.size() != device->cards_.size()) {
+            device->shown_ = CardFrames(device->cards_.size());
+        }
+    }
+    device->staged_ = CardFrames(device->shown_.size());
+    return device;
+}
+
+bool AE5Device::set_frame(size_t card, const LEDFrame& frame) {
+    if (card >= num_cards()) {
+        fprintf(stderr, "Error: Card %zu not found (%zu card(s) present)\n", card, num_cards());
+        return false;
+    }
+    staged_.set(card, frame);
+    layer_leds_[card] = (1 << NUM_LEDS) - 1;
+    return true;
+}
+
+bool AE5Device::set_led(size_t card, int led, const RGB& color, uint8_t brightness) {
+    if (led < 0 || led >= NUM_LEDS) {
+        fprintf(stderr, "Error: LED position must be between 0 and %d\n", NUM_LEDS - 1);
+        return false;
+    }
+    if (card >= num_cards()) {
+        fprintf(stderr, "Error: Card %zu not found (%zu card(s) present)\n", card, num_cards());
+        return false;
+    }
+    if (!staged_.has(card)) {
+        staged_.set(card, shown_.frames[card]);
+    }
+    staged_.frames[card].colors[led] = color;
+    staged_.frames[card].brightness[led] = brightness;
+    layer_leds_[card] |= 1 << led;
+    return true;
+}
+
+bool AE5Device::commit(bool force, uint32_t fade_ms) {
+    CardFrames frames = force ? staged_ : changed_frames(staged_, shown_);
+    staged_.present = 0;
+    if (!frames.present) {
+        return true;
+    }
+    bool ok = is_direct() ? commit_direct(frames, fade_ms) : commit_daemon(frames, force, fade_ms);
+    if (ok) {
+        merge_card_frames(shown_, frames);
+    }
+    return ok;
+}
+
+bool AE5Device::commit_direct(const CardFrames& frames, uint32_t fade_ms) {
+    uint64_t failures = 0;
+    for (const auto& card : cards_) failures += card->stats.failures.value();
+
+    if (fade_ms > 0) {
+        fade_card_frames(cards_, shown_, frames, fade_ms, options_.fade_fps);
+    } else {
+        send_card_frames(cards_, frames);
+    }
+
+    for (const auto& card : cards_) failures -= card->stats.failures.value();
+    if (failures != 0) {
+        return false;
+    }
+
+    CardFrames state = shown_;
+    merge_card_frames(state, frames);
+    save_frame_state(options_.state_path, state);
+    return true;
+}
+
+// One request per card keeps each line well under DAEMON_MAX_LINE; the
+// replies are read once every request is out
+bool AE5Device::commit_daemon(const CardFrames& frames, bool force, uint32_t fade_ms) {
+    std::string requests;
+    int pending = 0;
+    char token[64];
+    for (size_t card = 0; card < frames.size(); card++) {
+        if (!frames.has(card)) continue;
+        if (force) requests += "--force ";
+        if (fade_ms > 0) requests += "--fade " + std::to_string(fade_ms) + " ";
+        if (options_.layer) {
+            requests += std::string("--layer ") + options_.layer + " ";
+            if (options_.layer_priority >= 0) requests += "--priority " + std::to_string(options_.layer_priority) + " ";
+            if (options_.layer_opacity >= 0) requests += "--opacity " + std::to_string(options_.layer_opacity) + " ";
+            if (options_.layer_ttl_ms > 0) requests += "--ttl " + std::to_string(options_.layer_ttl_ms) + " ";
+        }
+        const LEDFrame& frame = frames.frames[card];
+        bool first = true;
+        for (int led = 0; led < NUM_LEDS; led++) {
+            if (options_.layer && !((layer_leds_[card] >> led) & 0x01)) continue;
+            snprintf(token, sizeof(token), "%s%zu:%d:%d,%d,%d@%d", first ? "" : " ", card, led,
+                     frame.colors[led].red, frame.colors[led].green, frame.colors[led].blue, frame.brightness[led]);
+            requests += token;
+            first = false;
+        }
+        requests += "\n";
+        pending++;
+    }
+
+    if (send(daemon_fd_.get(), requests.data(), requests.size(), MSG_NOSIGNAL) != (ssize_t)requests.size()) {
+        perror("Failed to send frames to the daemon");
+        return false;
+    }
+    bool ok = true;
+    std::string reply;
+    for (; pending > 0; pending--) {
+        if (!read_reply(reply)) {
+            fprintf(stderr, "Error: The daemon closed the connection\n");
+            return false;
+        }
+        ok = ok && reply == "OK";
+    }
+    return ok;
+}
+
+// Next line from the daemon, without the newline
+bool AE5Device::read_reply(std::string& reply) {
+    size_t pos;
+    while ((pos = replies_.find('\n')) == std::string::npos) {
+        char buf[256];
+        ssize_t n = recv(daemon_fd_.get(), buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        replies_.append(buf, n);
+    }
+    reply = replies_.substr(0, pos);
+    replies_.erase(0, pos + 1);
+    return true;
+}
@@ -0,0 +1,1038 @@
+/**
+ * libae5rgb: driving the LEDs of Sound Blaster AE-5 cards.
+ *
+ * The frame pipeline (discovery, BAR mapping, the frame compiler, fades and
+ * the state file) that the ae5-rgb command line is built on, and AE5Device,
+ * a handle for programs that want to set colors without running it.
+ */
+#ifndef AE5RGB_H
+#define AE5RGB_H
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <cstdint>
+#include <unistd.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef AE5_WITH_TRACE
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Hardware configuration constants
+#define MMIO_REGION_SIZE 0x1024
+#define LED_CONTROL_OFFSET 0x320
+#define NUM_LEDS 5
+#define MAX_CARDS 8
+
+// LED protocol constants
+#define START_FRAME_BITS 32
+#define BRIGHTNESS_BITS 8 // LED header byte: LED_HEADER_MARKER, then the global brightness
+#define LED_HEADER_MARKER 0xE0 // the top three bits of the header are always 1
+#define GLOBAL_BRIGHTNESS_BITS 5
+#define COLOR_BITS 24
+#define END_FRAME_BITS 32
+#define WRITE_ITERATIONS 2 // sends per frame at most, with --verify
+#define MAX_BRIGHTNESS 0xFF
+
+// Compiled frame layout (each bit is a data write followed by a clock pulse)
+#define WRITES_PER_BIT 3
+#define LED_FRAME_BITS (BRIGHTNESS_BITS + COLOR_BITS)
+#define FRAME_BITS (START_FRAME_BITS + NUM_LEDS * LED_FRAME_BITS + END_FRAME_BITS)
+#define FRAME_WRITES (FRAME_BITS * WRITES_PER_BIT)
+#define FRAME_CACHE_SIZE 16
+
+// LED protocol values
+#define LED_BIT_LOW 0x02
+#define LED_BIT_HIGH 0x102
+#define LED_CLOCK_HIGH 0x103
+#define LED_CLOCK_LOW 0x03
+
+// PCI device identification
+#define TARGET_VENDOR "1102"
+#define TARGET_DEVICE "0012"
+#define TARGET_REGION 2
+#define PCI_DEVICES_PATH "/sys/bus/pci/devices"
+#define DISCOVERY_CACHE_PATH "/run/ae5-rgb.device"
+
+// Daemon socket, also used by the library's client
+#define DAEMON_SOCKET_PATH "/run/ae5-rgb.sock"
+#define DAEMON_MAX_LINE 1024
+#define DAEMON_LAYER_NAME_MAX 31
+
+// Last committed frame, used to skip writes that would not change anything
+#define STATE_FILE_PATH "/run/ae5-rgb.state"
+#define STATE_FILE_MAGIC 0x34533541 // "AE5S" followed by format version 4
+#define SUSPEND_SLACK_NS 1000000000ULL // less time suspended than this is not a sleep
+
+// Clock calibration results survive reboots, unlike the state in /run
+#define CALIBRATION_FILE_PATH "/var/lib/ae5-rgb.calibration"
+#define CALIBRATION_MAX_SPACING 16
+
+// Fades
+#define FADE_GAMMA 2.2
+#define FADE_MAX_MS 60000
+#define FADE_DEFAULT_FPS 30
+#define FRAME_LANES 8 // LEDs per FrameSoA plane, NUM_LEDS rounded up to a vector
+
+// Metrics export
+#define METRICS_BUCKETS 16
+
+// Tracing (only with -DAE5_WITH_TRACE)
+#define TRACE_EVENTS 65536 // ring buffer size, a power of two
+
+// Type definition for MMIO register access
+typedef volatile uint32_t* mmio_reg_t;
+
+/**
+ * Structure to represent RGB color values
+ * Each component ranges from 0-255
+ */
+struct RGB {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+
+    RGB(uint8_t r = 0, uint8_t g = 0, uint8_t b = 0) : red(r), green(g), blue(b) {}
+};
+
+// LED color configuration structure
+struct LEDConfig {
+    int card;       // -1 applies to every card
+    int position;
+    RGB color;
+    int brightness; // -1 uses the global brightness
+    
+    LEDConfig(int pos, const RGB& c, int b = -1, int cd = -1)
+        : card(cd), position(pos), color(c), brightness(b) {}
+};
+
+// Color and brightness of every LED in the chain
+struct LEDFrame {
+    RGB colors[NUM_LEDS];
+    uint8_t brightness[NUM_LEDS];
+
+    LEDFrame() { memset(brightness, MAX_BRIGHTNESS, sizeof(brightness)); }
+};
+
+static_assert(NUM_LEDS <= 8 && MAX_CARDS <= 8, "LED and card sets are kept in 8-bit masks");
+
+/**
+ * One frame per card, in a fixed-size block so building, copying and
+ * diffing frames never allocates. Only the frames of the cards in present
+ * are meant: for a request they are the cards it addresses, for the
+ * committed state the cards whose frame is known.
+ */
+struct alignas(64) CardFrames {
+    LEDFrame frames[MAX_CARDS];
+    uint8_t num_cards;
+    uint8_t present; // bit n: the frame of card n is set
+
+    explicit CardFrames(size_t n = 0) : num_cards(n), present(0) {}
+    size_t size() const { return num_cards; }
+    bool has(size_t card) const { return (present >> card) & 0x01; }
+    void set(size_t card, const LEDFrame& frame) {
+        frames[card] = frame;
+        present |= 1 << card;
+    }
+    void set_all() { present = (1 << num_cards) - 1; }
+};
+
+/**
+ * LED settings of a request, parsed straight into fixed arrays. Slot 0 holds
+ * the settings for every card, slot n + 1 those for card n; present has bit
+ * n set for each LED n given a color. Brightness -1 means the global one.
+ */
+struct alignas(64) FrameRequest {
+    RGB colors[MAX_CARDS + 1][NUM_LEDS];
+    int16_t brightness[MAX_CARDS + 1][NUM_LEDS];
+    uint8_t present[MAX_CARDS + 1];
+
+    FrameRequest() { clear(); }
+    void clear() { memset(present, 0, sizeof(present)); }
+    bool empty() const {
+        for (uint8_t mask : present) {
+            if (mask) return false;
+        }
+        return true;
+    }
+
+    void set(const LEDConfig& config) {
+        int slot = config.card + 1;
+        if (present[slot] & (1 << config.position)) {
+            fprintf(stderr, "Warning: Multiple colors specified for LED %d. Using the last one.\n",
+                    config.position);
+        }
+        colors[slot][config.position] = config.color;
+        brightness[slot][config.position] = config.brightness;
+        present[slot] |= 1 << config.position;
+    }
+
+    void set_all(const RGB& color) {
+        for (int led = 0; led < NUM_LEDS; led++) {
+            colors[0][led] = color;
+            brightness[0][led] = -1;
+        }
+        present[0] = (1 << NUM_LEDS) - 1;
+    }
+};
+
+class ScopedFD {
+public:
+    explicit ScopedFD(int fd) : fd_(fd) {}
+    ~ScopedFD() { if (fd_ >= 0) close(fd_); }
+    int get() const { return fd_; }
+    int release() { int tmp = fd_; fd_ = -1; return tmp; }
+    void reset(int fd) { if (fd_ >= 0) close(fd_); fd_ = fd; }
+private:
+    int fd_;
+    // Prevent copying
+    ScopedFD(const ScopedFD&) = delete;
+    ScopedFD& operator=(const ScopedFD&) = delete;
+};
+
+class ScopedMMIO {
+public:
+    ScopedMMIO(void* base, size_t size) : base_(base), size_(size) {}
+    ~ScopedMMIO() { 
+        if (base_ != MAP_FAILED) {
+            munmap(base_, size_);
+        }
+    }
+    void* get() const { return base_; }
+    void reset(void* base, size_t size) {
+        if (base_ != MAP_FAILED) {
+            munmap(base_, size_);
+        }
+        base_ = base;
+        size_ = size;
+    }
+private:
+    void* base_;
+    size_t size_;
+    // Prevent copying
+    ScopedMMIO(const ScopedMMIO&) = delete;
+    ScopedMMIO& operator=(const ScopedMMIO&) = delete;
+};
+
+bool check_root_privileges();
+
+/*
+ * Ordering of the register stores. On an uncached mapping (sysfs resource or
+ * /dev/mem with O_SYNC) the CPU keeps stores in program order and never
+ * merges them, so volatile is all the LED protocol needs. A write-combining
+ * mapping may merge or reorder stores until a fence drains the buffer, and
+ * since every LED store goes to the same register, every one needs a fence
+ * after it or data and clock edges collapse into a single write.
+ */
+inline void mmio_store_fence() {
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile("sfence" : : : "memory");
+#elif defined(__aarch64__)
+    asm volatile("dmb oshst" : : : "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+inline void write_mmio(void* base, uint32_t offset, uint32_t value) {
+    mmio_reg_t reg = (mmio_reg_t)((uint8_t*)base + offset);
+    *reg = value;
+}
+
+inline uint32_t read_mmio(void* base, uint32_t offset) {
+    mmio_reg_t reg = (mmio_reg_t)((uint8_t*)base + offset);
+    return *reg;
+}
+
+/*
+ * I/O backends for the frame writers. Each provides write(offset, value) and
+ * read(offset) and is passed as a template parameter, so the hot loops are inlined for the
+ * backend in use instead of calling through a pointer.
+ */
+
+// A mapped BAR (sysfs resource or /dev/mem), or plain memory for dry runs.
+// Stores to a write-combining mapping are fenced one by one.
+class MMIOBackend {
+public:
+    explicit MMIOBackend(void* base, bool write_combining = false)
+        : base_(base), write_combining_(write_combining) {}
+    void write(uint32_t offset, uint32_t value) {
+        write_mmio(base_, offset, value);
+        if (write_combining_) mmio_store_fence();
+    }
+    uint32_t read(uint32_t offset) { return read_mmio(base_, offset); }
+    void* base() const { return base_; }
+    bool write_combining() const { return write_combining_; }
+private:
+    void* base_;
+    bool write_combining_;
+};
+
+// Captures the register-write sequence so encoder output can be checked
+class RecordingBackend {
+public:
+    struct Write {
+        uint32_t offset;
+        uint32_t value;
+
+        bool operator==(const Write& other) const { return offset == other.offset && value == other.value; }
+    };
+
+    void write(uint32_t offset, uint32_t value) { writes.push_back({offset, value}); }
+
+    // Reads back the last value written to the offset, like a plain register
+    uint32_t read(uint32_t offset) {
+        reads++;
+        for (size_t i = writes.size(); i-- > 0;) {
+            if (writes[i].offset == offset) return writes[i].value;
+        }
+        return 0;
+    }
+
+    std::vector<Write> writes;
+    size_t reads = 0;
+};
+
+/**
+ * Model of a card that samples the data bit on the rising edge of register
+ * bit 8, with bit 0 holding the inverted data. The reference sequence decodes
+ * to its own bits under this model, so any encoding that decodes to the same
+ * bits is equivalent on such a card.
+ */
+struct LatchModelBackend {
+    void write(uint32_t offset, uint32_t value) {
+        if (offset != LED_CONTROL_OFFSET) return;
+        if (!(last_ & 0x100) && (value & 0x100)) {
+            bits.push_back(!(value & 0x01));
+        }
+        last_ = value;
+    }
+    uint32_t read(uint32_t) { return last_; }
+
+    std::vector<bool> bits;
+
+private:
+    uint32_t last_ = LED_CLOCK_LOW;
+};
+
+// Discards every write, so only the cost of producing the values is measured
+class NullBackend {
+public:
+    void write(uint32_t, uint32_t value) {
+        // Keep the value alive so the encoder is not optimized away
+        asm volatile("" : : "r"(value));
+    }
+    uint32_t read(uint32_t) { return 0; }
+};
+
+// PCI device holding the LED control registers
+struct PCIDevice {
+    std::string bdf;
+    uint64_t bar_start;
+    uint64_t bar_end;
+
+    PCIDevice() : bar_start(0), bar_end(0) {}
+};
+
+// Discovery and mapping; find_mmio_base_addresses() throws std::runtime_error
+// if no card is found
+bool normalize_bdf(const char* str, std::string& bdf);
+std::vector<PCIDevice> find_mmio_base_addresses(const std::vector<std::string>& bdfs);
+// write_combining asks for the BAR's write-combining mapping (resourceN_wc);
+// it is cleared if the mapping returned is uncached
+void* map_device_bar(const PCIDevice& device, size_t& size, bool& write_combining);
+
+/*
+ * Tracing. Built with -DAE5_WITH_TRACE (both the library and the program),
+ * AE5_TRACE_SCOPE records a span from that point to the end of the scope into
+ * a preallocated ring of TRACE_EVENTS entries, timestamped with the TSC.
+ * trace_start() turns recording on and dumps the ring as Chrome trace JSON
+ * (chrome://tracing, Perfetto) when the program exits or dies of a signal.
+ * Without the define the hooks compile to nothing.
+ */
+#ifdef AE5_WITH_TRACE
+struct TraceEvent {
+    const char* name; // a string literal
+    uint64_t start;   // trace_clock() ticks
+    uint64_t end;
+    int32_t arg;      // LED or attempt number, -1 for none
+    uint32_t tid;
+};
+
+extern std::atomic<bool> g_trace_enabled;
+
+void trace_start(const char* path);
+void trace_record(const char* name, uint64_t start, int32_t arg);
+
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+class TraceScope {
+public:
+    TraceScope(const char* name, int32_t arg) : name_(name), arg_(arg), start_(trace_clock()) {}
+    ~TraceScope() {
+        if (g_trace_enabled.load(std::memory_order_relaxed)) trace_record(name_, start_, arg_);
+    }
+private:
+    const char* name_;
+    int32_t arg_;
+    uint64_t start_;
+};
+
+#define AE5_TRACE_SCOPE(name, arg) TraceScope ae5_trace_scope_(name, arg)
+#else
+#define AE5_TRACE_SCOPE(name, arg) ((void)0)
+#endif
+
+uint32_t rgb_to_hex(const RGB& color);
+
+template <typename Backend>
+void write_led_bit(Backend& io, bool is_high) {
+    io.write(LED_CONTROL_OFFSET, is_high ? LED_BIT_HIGH : LED_BIT_LOW);
+    io.write(LED_CONTROL_OFFSET, LED_CLOCK_HIGH);
+    io.write(LED_CONTROL_OFFSET, LED_CLOCK_LOW);
+}
+
+template <typename Backend>
+void send_start_frame(Backend& io) {
+    AE5_TRACE_SCOPE("send_start_frame", -1);
+    for (int i = 0; i < START_FRAME_BITS; i++) {
+        write_led_bit(io, false);
+    }
+}
+
+// Header byte of an LED field: the marker bits and the 0-255 brightness as 5-bit global brightness
+constexpr uint8_t led_header(uint8_t brightness) {
+    return LED_HEADER_MARKER | brightness >> (8 - GLOBAL_BRIGHTNESS_BITS);
+}
+
+template <typename Backend>
+void send_led_color(Backend& io, uint32_t color_value, uint8_t brightness) {
+    AE5_TRACE_SCOPE("send_led_color", -1);
+    // Send the header byte
+    uint8_t header = led_header(brightness);
+    for (int i = 0; i < BRIGHTNESS_BITS; i++) {
+        write_led_bit(io, (header >> (BRIGHTNESS_BITS - 1 - i)) & 0x01);
+    }
+
+    // Send color bits
+    for (int i = 0; i < COLOR_BITS; i++) {
+        uint32_t bit = (color_value >> (23 - i)) & 0x01;
+        write_led_bit(io, bit == 1);
+    }
+}
+
+template <typename Backend>
+void send_end_frame(Backend& io) {
+    AE5_TRACE_SCOPE("send_end_frame", -1);
+    for (int i = 0; i < END_FRAME_BITS; i++) {
+        write_led_bit(io, true);
+    }
+}
+
+// Order in which the color channels are sent, first channel first
+enum ChannelOrder {
+    CHANNELS_BGR, // AE-5, as packed by rgb_to_hex()
+    CHANNELS_RGB,
+    CHANNELS_GRB
+};
+
+/**
+ * A whole frame encoded as the exact sequence of values written to
+ * LED_CONTROL_OFFSET, so it can be streamed without any per-bit work.
+ */
+template <int Writes>
+struct EncodedFrame {
+    uint32_t writes[Writes];
+};
+
+// The writes that never depend on the colors: start and end frames and every
+// clock pulse. The data writes of the LED fields are filled in at runtime.
+template <int Bits, int EndBits>
+constexpr EncodedFrame<Bits * WRITES_PER_BIT> make_frame_template() {
+    EncodedFrame<Bits * WRITES_PER_BIT> frame{};
+    for (int bit = 0; bit < Bits; bit++) {
+        frame.writes[bit * WRITES_PER_BIT] = bit >= Bits - EndBits ? LED_BIT_HIGH : LED_BIT_LOW;
+        frame.writes[bit * WRITES_PER_BIT + 1] = LED_CLOCK_HIGH;
+        frame.writes[bit * WRITES_PER_BIT + 2] = LED_CLOCK_LOW;
+    }
+    return frame;
+}
+
+/**
+ * Frame encoder specialized at compile time on the LED count, the field
+ * widths and the channel order. The constant writes come from a table built
+ * at compile time and the per-LED loops are unrolled, so encoding a frame is
+ * a copy plus straight-line, branch-free stores of the live data bits.
+ */
+template <int LedCount, int StartBits, int BrightnessBits, int ColorBits, int EndBits, ChannelOrder Order>
+class FrameEncoder {
+public:
+    static constexpr int LED_BITS = BrightnessBits + ColorBits;
+    static constexpr int BITS = StartBits + LedCount * LED_BITS + EndBits;
+    static constexpr int WRITES = BITS * WRITES_PER_BIT;
+    typedef EncodedFrame<WRITES> Frame;
+
+    static_assert(ColorBits % 3 == 0 && ColorBits <= 24, "Color channels are at most 8 bits each");
+    static_assert(BrightnessBits <= 8, "Brightness is at most 8 bits");
+    static_assert(LED_BITS <= 32, "An LED field must fit in 32 bits");
+
+    static void encode(const RGB* colors, const uint8_t* brightness, Frame& frame) {
+        frame = kTemplate;
+        encode_leds(colors, brightness, frame, std::make_index_sequence<LedCount>());
+    }
+
+    // Rewrite only the header bits of one LED; the color bits are left untouched
+    static void set_brightness(Frame& frame, int led, uint8_t brightness) {
+        write_bits<BrightnessBits>(frame.writes + (StartBits + led * LED_BITS) * WRITES_PER_BIT,
+                                   header(brightness), std::make_index_sequence<BrightnessBits>());
+    }
+
+    // The top BrightnessBits of the LED header byte
+    static constexpr uint32_t header(uint8_t brightness) {
+        return led_header(brightness) >> (8 - BrightnessBits);
+    }
+
+    static uint32_t pack(const RGB& color) {
+        constexpr int channel_bits = ColorBits / 3;
+        uint32_t r = color.red >> (8 - channel_bits);
+        uint32_t g = color.green >> (8 - channel_bits);
+        uint32_t b = color.blue >> (8 - channel_bits);
+        if (Order == CHANNELS_BGR) return (b << (2 * channel_bits)) | (g << channel_bits) | r;
+        if (Order == CHANNELS_RGB) return (r << (2 * channel_bits)) | (g << channel_bits) | b;
+        return (g << (2 * channel_bits)) | (r << channel_bits) | b;
+    }
+
+private:
+    static constexpr Frame kTemplate = make_frame_template<BITS, EndBits>();
+    static constexpr uint32_t DATA_FLIP = LED_BIT_HIGH ^ LED_BIT_LOW;
+
+    // Data writes for the Count bits of value, most significant bit first
+    template <int Count, size_t... I>
+    static void write_bits(uint32_t* out, uint32_t value, std::index_sequence<I...>) {
+        ((out[I * WRITES_PER_BIT] = LED_BIT_LOW ^ (((value >> (Count - 1 - I)) & 0x01) * DATA_FLIP)), ...);
+    }
+
+    template <size_t... L>
+    static void encode_leds(const RGB* colors, const uint8_t* brightness, Frame& frame, std::index_sequence<L...>) {
+        (write_bits<LED_BITS>(frame.writes + (StartBits + L * LED_BITS) * WRITES_PER_BIT,
+                              (header(brightness[L]) << ColorBits) | pack(colors[L]),
+                              std::make_index_sequence<LED_BITS>()), ...);
+    }
+};
+
+typedef FrameEncoder<NUM_LEDS, START_FRAME_BITS, BRIGHTNESS_BITS, COLOR_BITS, END_FRAME_BITS, CHANNELS_BGR> AE5Encoder;
+typedef AE5Encoder::Frame CompiledFrame;
+static_assert(AE5Encoder::WRITES == FRAME_WRITES, "AE-5 encoder layout does not match the protocol constants");
+
+inline void compile_frame(const LEDFrame& led_frame, CompiledFrame& frame) {
+    AE5Encoder::encode(led_frame.colors, led_frame.brightness, frame);
+}
+
+// Patch only the brightness field of a compiled frame; the color bits are left untouched
+inline void set_compiled_brightness(CompiledFrame& frame, int led, uint8_t brightness) {
+    AE5Encoder::set_brightness(frame, led, brightness);
+}
+
+inline void set_compiled_global_brightness(CompiledFrame& frame, uint8_t brightness) {
+    for (int led = 0; led < NUM_LEDS; led++) {
+        set_compiled_brightness(frame, led, brightness);
+    }
+}
+
+/**
+ * Store sequences a compiled frame can be clocked out with.
+ *
+ * Bit 8 of the control register rises once per bit in the reference
+ * sequence, and at that rising edge bit 0 always holds the inverted data bit
+ * (0x102 for a one, 0x103 for a zero), so a card that samples data on that
+ * edge only needs two stores per bit: the rising-edge value and LED_CLOCK_LOW.
+ * That is ENCODING_MERGED. Whether the AE-5 really latches that way can only
+ * be seen on the LEDs, so it is never used unless --calibrate confirmed it.
+ * ENCODING_SKIP_CLOCK_LOW leaves bit 8 high between consecutive ones, so such
+ * a card sees no edge for the second one; it is not a calibration candidate.
+ */
+enum FrameEncoding {
+    ENCODING_FULL,           // data, clock high, clock low: the original sequence
+    ENCODING_SKIP_CLOCK_LOW, // data, clock high; one clock low ends the frame
+    ENCODING_MERGED          // data merged into the clock edge, clock low
+};
+
+/**
+ * How a compiled frame is clocked out. spacing is the number of register
+ * readbacks after every store; each one waits for the posted writes to reach
+ * the card, so it paces the clock in units of the bus round trip. The default
+ * is the original back-to-back three-store sequence. write_combining selects
+ * the write-combining mapping of the BAR, which only --calibrate turns on.
+ */
+struct FrameTiming {
+    int spacing;
+    FrameEncoding encoding;
+    bool write_combining;
+
+    FrameTiming(int s = 0, FrameEncoding e = ENCODING_FULL, bool wc = false)
+        : spacing(s), encoding(e), write_combining(wc) {}
+    int stores() const {
+        if (encoding == ENCODING_SKIP_CLOCK_LOW) return FRAME_BITS * 2 + 1;
+        if (encoding == ENCODING_MERGED) return FRAME_BITS * 2;
+        return FRAME_WRITES;
+    }
+};
+
+template <bool Paced, typename Backend>
+inline void paced_write(Backend& io, uint32_t value, int spacing) {
+    io.write(LED_CONTROL_OFFSET, value);
+    for (int i = 0; Paced && i < spacing; i++) {
+        io.read(LED_CONTROL_OFFSET);
+    }
+}
+
+// Stream bits [first_bit, end_bit) of the frame
+template <FrameEncoding Encoding, bool Paced, typename Backend>
+void stream_writes(Backend& io, const CompiledFrame& frame, int spacing, int first_bit = 0,
+                   int end_bit = FRAME_BITS) {
+    for (int i = first_bit * WRITES_PER_BIT; i < end_bit * WRITES_PER_BIT; i += WRITES_PER_BIT) {
+        if (Encoding == ENCODING_MERGED) {
+            // 0x102 for a one, 0x103 for a zero
+            paced_write<Paced>(io, LED_CLOCK_HIGH ^ ((frame.writes[i] >> 8) & 0x01), spacing);
+            paced_write<Paced>(io, frame.writes[i + 2], spacing);
+        } else {
+            paced_write<Paced>(io, frame.writes[i], spacing);
+            paced_write<Paced>(io, frame.writes[i + 1], spacing);
+            if (Encoding == ENCODING_FULL) paced_write<Paced>(io, frame.writes[i + 2], spacing);
+        }
+    }
+    if (Encoding == ENCODING_SKIP_CLOCK_LOW && end_bit == FRAME_BITS) {
+        // Leave the clock where the reference sequence leaves it
+        io.write(LED_CONTROL_OFFSET, LED_CLOCK_LOW);
+    }
+}
+
+template <FrameEncoding Encoding, bool Paced, typename Backend>
+void stream_phases(Backend& io, const CompiledFrame& frame, int spacing) {
+#ifdef AE5_WITH_TRACE
+    // The same stores, cut at the field boundaries so each phase gets its own span
+    {
+        AE5_TRACE_SCOPE("stream start frame", -1);
+        stream_writes<Encoding, Paced>(io, frame, spacing, 0, START_FRAME_BITS);
+    }
+    for (int led = 0; led < NUM_LEDS; led++) {
+        AE5_TRACE_SCOPE("stream led", led);
+        int first_bit = START_FRAME_BITS + led * LED_FRAME_BITS;
+        stream_writes<Encoding, Paced>(io, frame, spacing, first_bit, first_bit + LED_FRAME_BITS);
+    }
+    AE5_TRACE_SCOPE("stream end frame", -1);
+    stream_writes<Encoding, Paced>(io, frame, spacing, FRAME_BITS - END_FRAME_BITS, FRAME_BITS);
+#else
+    stream_writes<Encoding, Paced>(io, frame, spacing);
+#endif
+}
+
+template <FrameEncoding Encoding, typename Backend>
+void stream_encoded(Backend& io, const CompiledFrame& frame, int spacing) {
+    if (spacing == 0) {
+        stream_phases<Encoding, false>(io, frame, 0);
+    } else {
+        stream_phases<Encoding, true>(io, frame, spacing);
+    }
+}
+
+template <typename Backend>
+void stream_frame(Backend& io, const CompiledFrame& frame, const FrameTiming& timing = FrameTiming()) {
+    switch (timing.encoding) {
+    case ENCODING_SKIP_CLOCK_LOW:
+        stream_encoded<ENCODING_SKIP_CLOCK_LOW>(io, frame, timing.spacing);
+        break;
+    case ENCODING_MERGED:
+        stream_encoded<ENCODING_MERGED>(io, frame, timing.spacing);
+        break;
+    default:
+        stream_encoded<ENCODING_FULL>(io, frame, timing.spacing);
+        break;
+    }
+}
+
+inline bool same_frame(const LEDFrame& a, const LEDFrame& b) {
+    return memcmp(&a, &b, sizeof(LEDFrame)) == 0;
+}
+
+/**
+ * Lookup tables for fades. The LEDs are linear in the value sent but the eye
+ * is not, so a straight blend races through the dark end. Fades are blended
+ * in perceptual space instead: colors through a 2.2 gamma curve, the
+ * brightness field through CIE lightness. encode maps a value sent to the
+ * card into perceptual space, decode maps it back.
+ */
+struct FadeTables {
+    uint8_t gamma_encode[256];
+    uint8_t gamma_decode[256];
+    uint8_t lightness_encode[256];
+    uint8_t lightness_decode[256];
+};
+
+/**
+ * A frame split into one plane per channel, each padded to FRAME_LANES, so
+ * blending two frames is a single loop over 32 bytes that the compiler turns
+ * into a handful of vector instructions. Values are in perceptual space.
+ */
+struct alignas(32) FrameSoA {
+    uint8_t red[FRAME_LANES];
+    uint8_t green[FRAME_LANES];
+    uint8_t blue[FRAME_LANES];
+    uint8_t brightness[FRAME_LANES];
+};
+
+static_assert(NUM_LEDS <= FRAME_LANES, "FRAME_LANES must hold every LED");
+
+const FadeTables& fade_tables();
+void encode_soa(const LEDFrame& frame, FrameSoA& soa);
+void decode_soa(const FrameSoA& soa, LEDFrame& frame);
+
+// a + (b - a) * t / 256 on every lane, t in [0, 256]; fits 16-bit lanes
+inline void lerp_soa(const FrameSoA& a, const FrameSoA& b, uint32_t t, FrameSoA& out) {
+    const uint8_t* pa = reinterpret_cast<const uint8_t*>(&a);
+    const uint8_t* pb = reinterpret_cast<const uint8_t*>(&b);
+    uint8_t* po = reinterpret_cast<uint8_t*>(&out);
+    const uint16_t wa = 256 - t, wb = t;
+    for (size_t i = 0; i < sizeof(FrameSoA); i++) {
+        po[i] = (uint16_t)(pa[i] * wa + pb[i] * wb) >> 8;
+    }
+}
+
+/**
+ * A fade of one card from one frame to another. Both ends are kept in
+ * perceptual space, so a step is one lerp_soa() and a table lookup per
+ * channel. The last step writes the target exactly, whatever the tables
+ * round it to.
+ */
+struct Transition {
+    FrameSoA from;
+    FrameSoA to;
+    LEDFrame target;
+    uint64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+    bool active = false;
+
+    void begin(const LEDFrame& current, const LEDFrame& next, uint64_t now, uint64_t duration) {
+        encode_soa(current, from);
+        encode_soa(next, to);
+        target = next;
+        start_ns = now;
+        duration_ns = duration;
+        active = duration > 0;
+    }
+
+    // The frame at now; the transition ends once that is the target
+    void render(uint64_t now, LEDFrame& frame) {
+        uint64_t elapsed = now > start_ns ? now - start_ns : 0;
+        if (elapsed >= duration_ns) {
+            frame = target;
+            active = false;
+            return;
+        }
+        FrameSoA step;
+        lerp_soa(from, to, elapsed * 256 / duration_ns, step);
+        decode_soa(step, frame);
+    }
+};
+
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Time spent suspended so far: CLOCK_BOOTTIME runs on through suspend, CLOCK_MONOTONIC stops
+// (monotonic read first, so the difference never goes below zero)
+inline uint64_t suspended_ns() {
+    uint64_t monotonic = monotonic_ns();
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - monotonic;
+}
+
+inline uint64_t raw_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Every metric has a single writing thread, so a relaxed load and store is
+// enough and keeps locked instructions off the frame path. Readers (the
+// metrics export) may see a value one update old.
+class MetricCounter {
+public:
+    void add(uint64_t n = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Latency histogram with power-of-two bucket bounds from 1us to 16ms; the
+// last bucket takes everything slower
+struct LatencyHistogram {
+    MetricCounter buckets[METRICS_BUCKETS];
+    MetricCounter sum_ns;
+
+    void record(uint64_t ns) {
+        int bucket = 0;
+        while (bucket < METRICS_BUCKETS - 1 && ns >= (1000ULL << bucket)) {
+            bucket++;
+        }
+        buckets[bucket].add();
+        sum_ns.add(ns);
+    }
+};
+
+// Small LRU cache of compiled frames, keyed by the LED frame
+class FrameCache {
+public:
+    FrameCache() : entries_(FRAME_CACHE_SIZE), clock_(0) {}
+
+    const CompiledFrame& get(const LEDFrame& led_frame) {
+        Entry* victim = &entries_[0];
+        for (auto& entry : entries_) {
+            if (entry.last_used != 0 && same_frame(entry.led_frame, led_frame)) {
+                entry.last_used = ++clock_;
+                hits.add();
+                return entry.frame;
+            }
+            if (entry.last_used < victim->last_used) {
+                victim = &entry;
+            }
+        }
+
+        victim->led_frame = led_frame;
+        compile_frame(led_frame, victim->frame);
+        victim->last_used = ++clock_;
+        misses.add();
+        return victim->frame;
+    }
+
+    MetricCounter hits;
+    MetricCounter misses;
+
+private:
+    struct Entry {
+        LEDFrame led_frame;
+        CompiledFrame frame;
+        uint64_t last_used = 0;
+    };
+    std::vector<Entry> entries_;
+    uint64_t clock_;
+};
+
+// Frame syntax of the command line and the daemon: "<r> <g> <b>", a lone
+// color, or "[<card>:]<position>:<color>[@<brightness>]" tokens
+inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool scan_number(const char*& p, unsigned max, unsigned& value);
+bool scan_color(const char*& p, RGB& color);
+bool parse_color(const char* str, RGB& color);
+bool parse_single_color(int argc, char* argv[], RGB& color);
+bool parse_brightness(const char* str, uint8_t& brightness);
+bool parse_led_token(const char* token, size_t length, LEDConfig& config);
+bool parse_led_configs(int argc, char* argv[], FrameRequest& request);
+bool parse_frame_line(const char* line, FrameRequest& request);
+// A daemon "frame" reply: a "<card>:<position>:#rrggbb@<brightness>" token per LED
+bool parse_frame_reply(const char* line, size_t card, LEDFrame& frame);
+// 1 to DAEMON_LAYER_NAME_MAX letters, digits, '-', '_' or '.'
+bool parse_layer_name(const char* str);
+
+// Turning requests into per-card frames and comparing them with the frames shown
+int highest_card(const FrameRequest& request);
+void build_frame(const FrameRequest& request, int card, uint8_t brightness, LEDFrame& frame);
+bool build_card_frames(const FrameRequest& request, size_t num_cards, uint8_t brightness,
+                       CardFrames& card_frames);
+bool frames_unchanged(const CardFrames& request, const CardFrames& last);
+CardFrames changed_frames(const CardFrames& request, const CardFrames& last);
+void merge_card_frames(CardFrames& last, const CardFrames& committed);
+
+template <typename Backend>
+void send_frame(Backend& io, const LEDFrame& led_frame, FrameCache* cache,
+                const FrameTiming& timing = FrameTiming()) {
+    if (cache) {
+        stream_frame(io, cache->get(led_frame), timing);
+        return;
+    }
+
+    CompiledFrame frame;
+    compile_frame(led_frame, frame);
+    stream_frame(io, frame, timing);
+}
+
+// The reference encoder: every bit written as it is produced
+template <typename Backend>
+void send_reference_frame(Backend& io, const LEDFrame& led_frame) {
+    send_start_frame(io);
+    for (int led = 0; led < NUM_LEDS; led++) {
+        send_led_color(io, rgb_to_hex(led_frame.colors[led]), led_frame.brightness[led]);
+    }
+    send_end_frame(io);
+}
+
+// Per-card write counters, only touched by the thread writing that card
+struct WriteStats {
+    MetricCounter frames;
+    MetricCounter retries;
+    MetricCounter failures;
+    LatencyHistogram encode;
+    LatencyHistogram write;
+};
+
+// Process-wide metrics, each field written by one thread
+struct Metrics {
+    MetricCounter discovery_ns;
+    MetricCounter mapping_ns;
+    MetricCounter requests;
+    MetricCounter request_errors;
+    MetricCounter coalesced;        // snapshots replaced before the writer took them
+    MetricCounter shared_updates;   // frames taken from the shared region
+    MetricCounter missed_deadlines;
+    MetricCounter dropped_frames;   // effect frames skipped to catch up
+    MetricCounter card_remaps;      // cards mapped again after coming back
+    MetricCounter resumes;          // resends after the system slept
+};
+
+extern Metrics g_metrics;
+
+// A mapped card; the mapping and its compiled frames live as long as this object
+class CardWorker; // writes the card's frames on its own thread, see send_card_frames()
+
+struct Card {
+    PCIDevice device;
+    ScopedMMIO mmio;
+    MMIOBackend io;
+    FrameCache cache;
+    FrameTiming timing;
+    bool verify = false;
+    WriteStats stats;
+    std::unique_ptr<CardWorker> worker; // started the first time the card is sent a frame with another card
+
+    Card(const PCIDevice& d, void* base, size_t size, bool write_combining = false);
+    ~Card();
+};
+
+typedef std::vector<std::unique_ptr<Card>> CardList;
+
+std::map<std::string, FrameTiming> load_calibration(const char* path);
+void save_calibration(const char* path, const std::map<std::string, FrameTiming>& timings);
+bool open_cards(const std::vector<PCIDevice>& devices, CardList& cards);
+// Map the card's BAR again, write-combining or not; false leaves the old mapping
+bool remap_card(Card& card, bool write_combining);
+// Probe a card that went away and came back (its BAR may have moved) and map
+// it again; false if it isn't there
+bool reopen_card(Card& card);
+bool open_all_cards(const std::vector<std::string>& bdfs, CardList& cards);
+void send_card_frame(Card& card, const LEDFrame& frame);
+void send_card_frames(CardList& cards, const CardFrames& card_frames);
+void enable_verification(CardList& cards);
+void print_write_stats(const CardList& cards);
+std::string format_metrics(const CardList& cards);
+void write_metrics_file(const char* path, const CardList& cards);
+
+// A null path disables the state file
+bool load_frame_state(const char* path, CardFrames& state);
+void save_frame_state(const char* path, const CardFrames& state);
+
+// Fade the cards from the frames they show to the request; blocks until done
+void fade_card_frames(CardList& cards, const CardFrames& shown, const CardFrames& request, uint32_t fade_ms,
+                      int fps);
+bool parse_fade(const char* str, uint32_t& fade_ms);
+
+// Connect to a running daemon; -1 if none is listening on path
+int connect_daemon_socket(const char* path);
+
+// How AE5Device::open() reaches the cards
+enum DeviceMode {
+    DEVICE_AUTO,   // a running daemon if there is one, else directly as root
+    DEVICE_DIRECT, // map the cards in this process (needs root)
+    DEVICE_DAEMON  // send every frame to the daemon
+};
+
+struct AE5DeviceOptions {
+    DeviceMode mode = DEVICE_AUTO;
+    std::vector<std::string> bdfs;              // explicit cards, skips discovery
+    const char* socket_path = DAEMON_SOCKET_PATH;
+    const char* state_path = STATE_FILE_PATH;   // shared with the CLI, nullptr for none
+    bool verify = false;                        // read back and resend like --verify
+    int fade_fps = FADE_DEFAULT_FPS;            // fade steps of direct commits
+
+    // Draw into this daemon layer instead of the frames without a layer
+    // (needs the daemon); only the LEDs this handle set are in the layer
+    const char* layer = nullptr;
+    int layer_priority = -1;                    // -1 for the daemon's defaults
+    int layer_opacity = -1;
+    uint32_t layer_ttl_ms = 0;                  // 0 for no TTL
+};
+
+/**
+ * Library handle on every AE-5 in the box, for programs that would otherwise
+ * run the CLI for each change. Discovery and mapping (or connecting to the
+ * daemon) happen once in open(); after that an update costs one frame write
+ * or one socket round trip.
+ *
+ * Changes are staged with set_frame() and set_led() and written by commit(),
+ * which skips cards whose frame did not change. A direct handle keeps the
+ * CLI's state file up to date. With a daemon running, even root goes through
+ * it, so two processes never clock frames into the same card at once.
+ */
+class AE5Device {
+public:
+    // nullptr, with the reason on stderr, if the cards can't be reached
+    static std::unique_ptr<AE5Device> open(const AE5DeviceOptions& options = AE5DeviceOptions());
+
+    size_t num_cards() const { return shown_.size(); }
+    bool is_direct() const { return daemon_fd_.get() < 0; }
+
+    // Stage a card's frame, or one LED on top of the frame staged or last committed
+    bool set_frame(size_t card, const LEDFrame& frame);
+    bool set_led(size_t card, int led, const RGB& color, uint8_t brightness = MAX_BRIGHTNESS);
+
+    // Write the staged frames, fading to them over fade_ms if given. The
+    // frames only count as shown once they were written without an error,
+    // so a failed commit is retried in full by the next one.
+    bool commit(bool force = false, uint32_t fade_ms = 0);
+
+    // The mapped cards of a direct handle; empty when going through the daemon
+    CardList& cards() { return cards_; }
+
+private:
+    AE5Device(int daemon_fd, const AE5DeviceOptions& options) : daemon_fd_(daemon_fd), options_(options) {}
+    bool commit_direct(const CardFrames& frames, uint32_t fade_ms);
+    bool commit_daemon(const CardFrames& frames, bool force, uint32_t fade_ms);
+    bool read_reply(std::string& reply);
+
+    CardList cards_;
+    ScopedFD daemon_fd_;
+    AE5DeviceOptions options_;
+    std::string replies_; // daemon output not yet consumed
+    CardFrames staged_;
+    CardFrames shown_;    // as far as this handle knows
+    uint8_t layer_leds_[MAX_CARDS] = {}; // bit n: LED n was set through this handle
+};
+
+#endif // AE5RGB_H